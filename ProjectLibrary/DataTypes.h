@@ -4,7 +4,12 @@
 #include <iostream>
 #include <assert.h>
 #include <cstdint>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "Eigen.h"
+#include "ThreadPool.h"
 
 // MATLAB-style macros to profile the execution time gains by parallelism (OpenMP)
 //#define TIMING_ENABLED
@@ -26,7 +31,44 @@
     #expr \
     << "' failed." << std::endl; exit(1);}}
 
-// PointCloud, with points normals and their validity
+// stable stream compaction of the indices [0, n) for which valid(i) holds, in parallel.
+// every block of indices counts its valid indices, the exclusive prefix sum of the counts gives the
+// offsets of the blocks in the output. resize(count) is called once, before write(i, j) stores index i at j
+template<typename Valid, typename Resize, typename Write>
+void compactIndices(size_t n, Valid valid, Resize resize, Write write)
+{
+    ThreadPool& pool = ThreadPool::global();
+    const size_t nBlocks = pool.size() + 1;
+    std::vector<size_t> offsets(nBlocks + 1, 0);
+    pool.parallelFor(nBlocks, [&](size_t block)
+    {
+        size_t count = 0;
+        for (size_t i = block * n / nBlocks; i < (block + 1) * n / nBlocks; ++i)
+        {
+            count += valid(i) ? 1 : 0;
+        }
+        offsets[block + 1] = count;
+    });
+    for (size_t block = 0; block < nBlocks; ++block)
+    {
+        offsets[block + 1] += offsets[block];
+    }
+    resize(offsets[nBlocks]);
+
+    pool.parallelFor(nBlocks, [&](size_t block)
+    {
+        size_t j = offsets[block];
+        for (size_t i = block * n / nBlocks; i < (block + 1) * n / nBlocks; ++i)
+        {
+            if (valid(i))
+            {
+                write(i, j++);
+            }
+        }
+    });
+}
+
+// PointCloud, with points normals and their validity (one byte per entry)
 // all std::vectors should always have eqal length, although this is not enforced by the class!
 struct PointCloud
 {
@@ -39,33 +81,155 @@ struct PointCloud
     {}
 
     std::vector<Vector3f> points;
-    std::vector<bool> pointsValid;
+    std::vector<uint8_t> pointsValid;
     std::vector<Vector3f> normals;
-    std::vector<bool> normalsValid;
+    std::vector<uint8_t> normalsValid;
 
-    // only keep points[i] and normals[i] where (pointsValid[i] && normalsValid[i])
+    // only keep points[i] and normals[i] where (pointsValid[i] && normalsValid[i]).
+    // the kept entries are compacted into the buffers of the last prune, which are then swapped in
     void prune()
     {
-        std::vector<bool> pointsAndNormalsValid;
-        std::transform(pointsValid.begin(), pointsValid.end(), normalsValid.begin(),
-                       std::back_inserter(pointsAndNormalsValid), std::logical_and<>());
+        ASSERT_NDBG((points.size() == normals.size()) && (pointsValid.size() == normalsValid.size()) && (points.size() == pointsValid.size()));
+
+        compactIndices(points.size(),
+                       [&](size_t i) { return pointsValid[i] && normalsValid[i]; },
+                       [&](size_t n) { m_prunedPoints.resize(n); m_prunedNormals.resize(n); },
+                       [&](size_t i, size_t j) { m_prunedPoints[j] = points[i]; m_prunedNormals[j] = normals[i]; });
+        points.swap(m_prunedPoints);
+        normals.swap(m_prunedNormals);
+        pointsValid.assign(points.size(), true);
+        normalsValid.assign(normals.size(), true);
+    }
+
+private:
+    std::vector<Vector3f> m_prunedPoints;
+    std::vector<Vector3f> m_prunedNormals;
+};
+
+// organized (image shaped) map of points and normals, e.g. the output of a raycast
+// channels are stored as structure of arrays and validity as one byte per pixel,
+// so different pixels can be written in parallel without races.
+// memory is allocated once by resize() and filled in place afterwards.
+struct SurfaceMap
+{
+    enum : uint8_t
+    {
+        POINT_VALID = 1,
+        NORMAL_VALID = 2
+    };
+
+    SurfaceMap(){}
+    SurfaceMap(size_t height, size_t width)
+    {
+        resize(height, width);
+    }
 
-        std::vector<Vector3f> points_;
-        std::vector<Vector3f> normals_;
-        for (size_t i = 0; i < pointsAndNormalsValid.size(); ++i)
+    // only reallocates if the size changes
+    void resize(size_t height, size_t width)
+    {
+        m_height = height;
+        m_width = width;
+        const size_t size = height*width;
+        for(auto channel : {&pointX, &pointY, &pointZ, &normalX, &normalY, &normalZ})
         {
-            if(pointsAndNormalsValid[i])
-            {
-                points_.push_back(points[i]);
-                normals_.push_back(normals[i]);
-            }
+            channel->resize(size);
         }
-        points = points_;
-        normals  = normals_;
-        pointsValid = std::vector<bool>(points.size(), true);
-        normalsValid = std::vector<bool>(normals.size(), true);
-        ASSERT_NDBG((points.size() == normals.size()) && (pointsValid.size() == normalsValid.size()) && (points.size() == pointsValid.size()));
+        mask.resize(size);
+    }
+
+    size_t size() const
+    {
+        return mask.size();
+    }
+
+    size_t height() const
+    {
+        return m_height;
+    }
+
+    size_t width() const
+    {
+        return m_width;
+    }
+
+    void setPoint(const size_t idx, const Vector3f& point)
+    {
+        pointX[idx] = point.x();
+        pointY[idx] = point.y();
+        pointZ[idx] = point.z();
+        mask[idx] |= POINT_VALID;
+    }
+
+    void setNormal(const size_t idx, const Vector3f& normal)
+    {
+        normalX[idx] = normal.x();
+        normalY[idx] = normal.y();
+        normalZ[idx] = normal.z();
+        mask[idx] |= NORMAL_VALID;
+    }
+
+    void setNormalInvalid(const size_t idx)
+    {
+        normalX[idx] = normalY[idx] = normalZ[idx] = MINF;
+        mask[idx] &= ~NORMAL_VALID;
+    }
+
+    void setInvalid(const size_t idx)
+    {
+        pointX[idx] = pointY[idx] = pointZ[idx] = MINF;
+        normalX[idx] = normalY[idx] = normalZ[idx] = MINF;
+        mask[idx] = 0;
+    }
+
+    Vector3f point(const size_t idx) const
+    {
+        return Vector3f(pointX[idx], pointY[idx], pointZ[idx]);
+    }
+
+    Vector3f normal(const size_t idx) const
+    {
+        return Vector3f(normalX[idx], normalY[idx], normalZ[idx]);
     }
+
+    bool pointValid(const size_t idx) const
+    {
+        return mask[idx] & POINT_VALID;
+    }
+
+    bool normalValid(const size_t idx) const
+    {
+        return mask[idx] & NORMAL_VALID;
+    }
+
+    // both point and normal are valid
+    bool valid(const size_t idx) const
+    {
+        return (mask[idx] & (POINT_VALID | NORMAL_VALID)) == (POINT_VALID | NORMAL_VALID);
+    }
+
+    // write all pixels with valid point and normal into pointCloud.
+    // the result equals a pruned PointCloud, the memory of pointCloud is reused.
+    void compact(PointCloud& pointCloud) const
+    {
+        compactIndices(size(),
+                       [&](size_t i) { return valid(i); },
+                       [&](size_t n) { pointCloud.points.resize(n); pointCloud.normals.resize(n); },
+                       [&](size_t i, size_t j) { pointCloud.points[j] = point(i); pointCloud.normals[j] = normal(i); });
+        pointCloud.pointsValid.assign(pointCloud.points.size(), true);
+        pointCloud.normalsValid.assign(pointCloud.normals.size(), true);
+    }
+
+    std::vector<float> pointX;
+    std::vector<float> pointY;
+    std::vector<float> pointZ;
+    std::vector<float> normalX;
+    std::vector<float> normalY;
+    std::vector<float> normalZ;
+    std::vector<uint8_t> mask;
+
+private:
+    size_t m_height = 0;
+    size_t m_width = 0;
 };
 
 // truncated signed distance function
@@ -162,6 +326,11 @@ public:
         return m_tsdf[idx];
     }
 
+    float operator()(const int idx) const
+    {
+        return m_tsdf[idx];
+    }
+
     uint_least8_t& weight(const int idx)
     {
         return m_weight[idx];
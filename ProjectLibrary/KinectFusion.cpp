@@ -2,25 +2,49 @@
 #include "StopWatch.h"
 
 
-KiFuModel::KiFuModel(VirtualSensor &InputHandle)
+KiFuModel::KiFuModel(VirtualSensor &InputHandle, TrackingMethod trackingMethod)
     : m_InputHandle(&InputHandle),
+      m_pool(ThreadPool::global()),
       m_refPoseGroundTruth((m_InputHandle->processNextFrame(), m_InputHandle->getTrajectory()))
 {
-    m_SurfaceMeasurer = std::make_unique<SurfaceMeasurer>(m_InputHandle->getDepthIntrinsics(),
-                                            m_InputHandle->getDepthImageHeight(),
-                                            m_InputHandle->getDepthImageWidth());
-
-    m_SurfaceMeasurer->registerInput(m_InputHandle->getDepth());
-    //m_SurfaceMeasurer->smoothInput();
-
-    m_SurfaceMeasurer->process();
+    const size_t depthSize = m_InputHandle->getDepthImageWidth() * m_InputHandle->getDepthImageHeight();
+    const size_t colorSize = 4 * m_InputHandle->getColorImageWidth() * m_InputHandle->getColorImageHeight();
+    for(size_t i = 0; i < m_pipelineDepth; ++i)
+    {
+        auto frame = std::make_unique<Frame>();
+        frame->depth.resize(depthSize);
+        frame->color.resize(colorSize);
+        // one pyramid level per tracking level
+        frame->measurer = std::make_unique<SurfaceMeasurer>(m_InputHandle->getDepthIntrinsics(),
+                                                            m_InputHandle->getDepthImageHeight(),
+                                                            m_InputHandle->getDepthImageWidth(),
+                                                            m_trackingIterations.size());
+        frame->measurer->registerInput(frame->depth.data());
+        m_frames.push_back(std::move(frame));
+    }
 
-    PointCloud Frame0 = m_SurfaceMeasurer->getPointCloud();
+    // the first frame is measured here, it defines the volume
+    Frame& frame0 = *m_frames[0];
+    std::copy(m_InputHandle->getDepth(), m_InputHandle->getDepth() + depthSize, frame0.depth.begin());
+    std::copy(m_InputHandle->getColorRGBX(), m_InputHandle->getColorRGBX() + colorSize, frame0.color.begin());
+    frame0.measurer->process();
 
-    PointCloud Frame0_pruned = Frame0;
-    Frame0_pruned.prune();
+    PointCloud Frame0;
+    frame0.measurer->getSurfaceMap().compact(Frame0);
 
-    m_PoseEstimator = std::make_unique<NearestNeighborPoseEstimator>();
+    if(trackingMethod == TrackingMethod::Projective)
+    {
+        m_PoseEstimator = std::make_unique<ProjectivePoseEstimator>(m_InputHandle->getDepthIntrinsics());
+    }
+    else
+    {
+        m_PoseEstimator = std::make_unique<NearestNeighborPoseEstimator>();
+    }
+    m_PoseEstimator->setIterations(m_trackingIterations);
+    m_PoseEstimator->setSampling(m_trackingSampling, m_trackingBudget);
+    // down weight outliers and the noisier far points
+    m_PoseEstimator->setRobustKernel(RobustKernel::Huber, 0.01f);
+    m_PoseEstimator->setDepthWeighting(true);
 
     // 512 will be ~500MB ram
     // 1024 -> 4GB
@@ -29,8 +53,9 @@ KiFuModel::KiFuModel(VirtualSensor &InputHandle)
 
     m_SurfaceReconstructor = std::make_unique<SurfaceReconstructor>(m_tsdf, m_InputHandle->getDepthIntrinsics());
 
-    m_SurfaceReconstructor->reconstruct(m_InputHandle->getDepth(),
-                                        m_InputHandle->getColorRGBX(),
+    // the unsmoothed depth is integrated, the tsdf averages the noise
+    m_SurfaceReconstructor->reconstruct(frame0.measurer->getRawDepth(),
+                                        frame0.color.data(),
                                         m_InputHandle->getDepthImageHeight(),
                                         m_InputHandle->getDepthImageWidth(),
                                         Matrix4f::Identity());
@@ -38,13 +63,24 @@ KiFuModel::KiFuModel(VirtualSensor &InputHandle)
     //m_tsdf->writeToFile("tsdf_frame0.ply", 0.01, 0);
 
     m_SurfacePredictor = std::make_unique<SurfacePredictor>(m_tsdf, m_InputHandle->getDepthIntrinsics());
+    // tracking only needs a subset of the predicted points
+    m_predictedPixels = SurfacePredictor::subsampledPixels(m_InputHandle->getDepthImageHeight(),
+                                                           m_InputHandle->getDepthImageWidth(),
+                                                           m_predictionStride);
+    // the subsampled pixels form an organized image again
+    m_predictedFrame.resize((m_InputHandle->getDepthImageHeight() + m_predictionStride - 1) / m_predictionStride,
+                            (m_InputHandle->getDepthImageWidth() + m_predictionStride - 1) / m_predictionStride);
 
     m_currentPose.push_back(Matrix4f::Identity());
     m_CamToWorld = Matrix4f::Identity();
+    m_posePredictor.addPose(m_CamToWorld);
     m_currentPoseGroundTruth.push_back(m_InputHandle->getTrajectory() * m_refPoseGroundTruth.inverse());
 
-    bool res;
-    prepareNextFrame(res);
+    for(auto& frame : m_frames)
+    {
+        m_freeFrames.push(frame.get());
+    }
+    scheduleDecode();
 
     //SimpleMesh camMesh = SimpleMesh::camera(m_currentPose.back());
     //camMesh.writeMesh("CamMesh.off");
@@ -73,70 +109,107 @@ KiFuModel::KiFuModel(VirtualSensor &InputHandle)
 
 }
 
-void KiFuModel::prepareNextFrame(bool& result)
+KiFuModel::~KiFuModel()
 {
-    StopWatch watch;
-    if(m_InputHandle->processNextFrame())
+    // the tasks use the slots and the sensor
+    m_stopping = true;
+    m_pool.waitUntil([this]() { return m_runningTasks == 0; });
+}
+
+void KiFuModel::scheduleDecode()
+{
+    if(!m_decoding.exchange(true))
     {
-        result = true;
-        return;
+        ++m_runningTasks;
+        m_pool.run([this]() { decodeFrames(); });
     }
+}
 
-
-    m_SurfaceMeasurer->registerInput(m_InputHandle->getDepth());
-    m_SurfaceMeasurer->process();
-
-    const std::lock_guard<std::mutex> lock(m_nextFrameMutex);
-    m_nextFrame = m_SurfaceMeasurer->getPointCloud();
-    m_nextFrame.prune();
-    result = false;
-    return;
+void KiFuModel::decodeFrames()
+{
+    do
+    {
+        Frame* frame;
+        while(!m_stopping && m_freeFrames.tryPop(frame))
+        {
+            frame->last = m_InputHandle->processNextFrame();
+            if(frame->last)
+            {
+                // m_decoding stays set, there is nothing left to decode
+                m_decodedFrames.push(frame);
+                --m_runningTasks;
+                return;
+            }
+
+            // the sensor buffers are overwritten by the next frame
+            std::copy(m_InputHandle->getDepth(), m_InputHandle->getDepth() + frame->depth.size(), frame->depth.begin());
+            std::copy(m_InputHandle->getColorRGBX(), m_InputHandle->getColorRGBX() + frame->color.size(), frame->color.begin());
+            frame->groundTruth = m_InputHandle->getTrajectory() * m_refPoseGroundTruth.inverse();
+
+            ++m_runningTasks;
+            frame->measured = m_pool.submit([this, frame]()
+            {
+                frame->measurer->process();
+                --m_runningTasks;
+            });
+            m_decodedFrames.push(frame);
+        }
+        m_decoding = false;
+        // a slot freed after the last tryPop would otherwise wait for the next processNextFrame
+    } while(!m_stopping && !m_freeFrames.empty() && !m_decoding.exchange(true));
+    --m_runningTasks;
 }
 
 bool KiFuModel::processNextFrame()
 {
-    // get V_k-1 N_k-1 from global model
-    PointCloud prevFrame;
+    if(m_finished)
     {
-        //StopWatch watch("SurfacePredictor");
-        prevFrame = m_SurfacePredictor->predict(m_InputHandle->getDepthImageHeight(),
-                                                m_InputHandle->getDepthImageWidth(),
-                                                m_currentPose.back());
-        prevFrame.prune();
+        return false;
     }
+    // help with decoding and measuring while waiting
+    Frame* frame;
+    m_pool.waitUntil([this, &frame]() { return m_decodedFrames.tryPop(frame); });
+    if(frame->last)
+    {
+        m_finished = true;
+        return false;
+    }
+    m_pool.waitUntil([frame]() { return frame->measured.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
 
+    // expected pose of the new frame (same convention as m_CamToWorld), and as stored in m_currentPose
+    const Matrix4f predictedCamToWorld = m_posePredictor.predict();
+    const Matrix4f predictedPose = predictedCamToWorld.inverse();
 
-    //StopWatch watch("PoseEstimator");
-
-    m_PoseEstimator->setTarget(prevFrame.points, prevFrame.normals);
+    // get V_k-1 N_k-1 from global model, seen from the predicted pose
     {
-        const std::lock_guard<std::mutex> lock(m_nextFrameMutex);
-        m_PoseEstimator->setSource(m_nextFrame.points, m_nextFrame.normals, 8);
+        //StopWatch watch("SurfacePredictor");
+        m_SurfacePredictor->predict(m_predictedFrame, m_predictedPixels,
+                                    m_InputHandle->getDepthImageWidth(),
+                                    predictedPose);
     }
-    // read out current ground truth before launching thread
-    m_currentPoseGroundTruth.push_back(m_InputHandle->getTrajectory() * m_refPoseGroundTruth.inverse());
 
-    bool isLastFrame;
-    std::thread nextFrameThread(&KiFuModel::prepareNextFrame, this, std::ref(isLastFrame));
 
-    m_CamToWorld = m_PoseEstimator->estimatePose(m_CamToWorld);
+    //StopWatch watch("PoseEstimator");
+
+    m_PoseEstimator->setTarget(m_predictedFrame, predictedPose, m_predictionStride);
+    m_PoseEstimator->setSourcePyramid(frame->measurer->getSurfaceMaps(), m_trackingStride);
+    m_currentPoseGroundTruth.push_back(frame->groundTruth);
+
+    m_CamToWorld = m_PoseEstimator->estimatePose(predictedCamToWorld);
+    m_posePredictor.addPose(m_CamToWorld);
     m_currentPose.push_back(m_CamToWorld.inverse());
     ASSERT_NDBG(m_currentPose.size() == m_currentPoseGroundTruth.size())
 
-    nextFrameThread.join();
-
-    // integrate the new frame in the tsdf
-    m_SurfaceReconstructor->reconstruct(m_InputHandle->getDepth(),
-                                        m_InputHandle->getColorRGBX(),
+    // integrate the new frame in the tsdf, the unsmoothed depth is integrated
+    m_SurfaceReconstructor->reconstruct(frame->measurer->getRawDepth(),
+                                        frame->color.data(),
                                         m_InputHandle->getDepthImageHeight(),
                                         m_InputHandle->getDepthImageWidth(),
                                         m_currentPose.back());
 
-    // actually skips the last frame, but that's ok
-    if(isLastFrame)
-    {
-        return false;
-    }
+    // the slot can take the next frame of the sensor
+    m_freeFrames.push(frame);
+    scheduleDecode();
     return true;
 }
 
@@ -158,3 +231,61 @@ void KiFuModel::saveScreenshot(std::string filename, const Matrix4f pose) const
 
 }
 
+
+
+void KiFuModel::saveScreenshots(std::string prefix, const std::vector<Matrix4f>& poses) const
+{
+    std::vector<RenderView> views(poses.size());
+    for(size_t i = 0; i < poses.size(); ++i)
+    {
+        views[i].pose = poses[i];
+        views[i].intrinsics = m_InputHandle->getDepthIntrinsics();
+        views[i].height = m_InputHandle->getDepthImageHeight();
+        views[i].width = m_InputHandle->getDepthImageWidth();
+    }
+    saveScreenshots(prefix, views);
+}
+
+static void saveRenderedView(const RenderedView& rendered, const std::string& prefix)
+{
+    const uint size = rendered.height*rendered.width;
+
+    FreeImageB color(rendered.width, rendered.height, 3);
+    std::copy(rendered.color.begin(), rendered.color.end(), color.data);
+    color.SaveImageToFile(prefix + "_color.png");
+
+    FreeImage depth(rendered.width, rendered.height, 1);
+    std::copy(rendered.depth.begin(), rendered.depth.end(), depth.data);
+    depth.normalize();
+    depth.SaveImageToFile(prefix + "_depth.png");
+
+    // map [-1, 1] to [0, 255], invalid normals are black
+    FreeImageB normal(rendered.width, rendered.height, 3);
+    for(uint i = 0; i < size*3; ++i)
+    {
+        const float n = rendered.normals[i];
+        normal.data[i] = std::isfinite(n) ? static_cast<BYTE>((n + 1) * 127.5f) : 0;
+    }
+    normal.SaveImageToFile(prefix + "_normal.png");
+}
+
+void KiFuModel::saveScreenshots(std::string prefix, const std::vector<RenderView>& views) const
+{
+    std::vector<std::future<void>> writers(views.size());
+
+    m_SurfacePredictor->render(views, [this, &writers, &prefix](size_t i, RenderedView& rendered)
+    {
+        // write the images on the pool, so the rendering thread can continue with the next view
+        auto images = std::make_shared<RenderedView>(std::move(rendered));
+        writers[i] = m_pool.submit([images, filename = prefix + std::to_string(i)]()
+        {
+            saveRenderedView(*images, filename);
+        });
+    });
+
+    // the waiting thread writes images as well
+    for(auto& writer : writers)
+    {
+        m_pool.waitUntil([&writer]() { return writer.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+    }
+}
@@ -3,8 +3,9 @@
 #include <string>
 #include <assert.h>
 #include <memory>
-#include <mutex>
+#include <atomic>
 #include <thread>
+#include <future>
 
 #include "Eigen.h"
 #include "VirtualSensor.h"
@@ -13,17 +14,32 @@
 #include "SurfaceReconstructor.h"
 #include "SurfaceMeasurer.h"
 #include "PoseEstimator.h"
+#include "PosePredictor.h"
 #include "SurfacePredictor.h"
+#include "SpscQueue.h"
+#include "ThreadPool.h"
 
 // debug
 #include "SimpleMesh.h"
 
+// how correspondences are found during tracking
+enum class TrackingMethod
+{
+    // nearest neighbor search in the predicted points
+    NearestNeighbor,
+    // projection into the predicted vertex and normal map
+    Projective
+};
+
 //template<class InputType>
 class KiFuModel
 {
 public:
-    KiFuModel(VirtualSensor & InputHandle);
+    KiFuModel(VirtualSensor & InputHandle, TrackingMethod trackingMethod = TrackingMethod::NearestNeighbor);
+    ~KiFuModel();
 
+    // track and integrate the next frame, false if the sensor has no more frames.
+    // the following frames are decoded and measured in the background meanwhile
     bool processNextFrame();
 
     // debug method
@@ -32,21 +48,74 @@ public:
     // debug method
     void saveScreenshot(std::string filename, const Matrix4f pose=Matrix4f::Identity()) const;
 
+    // debug method: render color, depth and normal images of several poses in parallel
+    // images are written to <prefix><i>_color.png, <prefix><i>_depth.png and <prefix><i>_normal.png
+    void saveScreenshots(std::string prefix, const std::vector<Matrix4f>& poses) const;
+    // same as above, with intrinsics and resolution per view
+    void saveScreenshots(std::string prefix, const std::vector<RenderView>& views) const;
+
 private:
-    void prepareNextFrame(bool &result);
+    // a frame on its way through the pipeline, the slots are allocated once and recycled
+    struct Frame
+    {
+        std::vector<float> depth;
+        std::vector<BYTE> color;
+        Matrix4f groundTruth;
+        // the sensor has no further frame, the slot holds no data
+        bool last = false;
+        // pyramid and unsmoothed depth of the frame, ready with measured
+        std::unique_ptr<SurfaceMeasurer> measurer;
+        std::future<void> measured;
+    };
+
+    // pipeline stages as tasks on m_pool: the sensor is read into the free slots in order, by one decode task
+    // at a time. each decoded frame is measured by a task of its own, so several frames can be measured at once.
+    // prediction, tracking and integration run in processNextFrame, as each of them needs the result of the
+    // previous one, and the prediction of the next frame needs the integration of this one
+    void scheduleDecode();
+    void decodeFrames();
 
     VirtualSensor* m_InputHandle;
+    // shared with the kernels of the components and other models
+    ThreadPool& m_pool;
 
-    std::unique_ptr<SurfaceMeasurer> m_SurfaceMeasurer;
     std::unique_ptr<PoseEstimator> m_PoseEstimator;
     std::unique_ptr<SurfaceReconstructor> m_SurfaceReconstructor;
     std::unique_ptr<SurfacePredictor> m_SurfacePredictor;
 
-    PointCloud m_nextFrame;
-    std::mutex m_nextFrameMutex;
+    // frames in flight: one being tracked, the others are decoded and measured meanwhile
+    static constexpr size_t m_pipelineDepth = 3;
+    std::vector<std::unique_ptr<Frame>> m_frames;
+    // free slots -> decode -> processNextFrame -> free slots
+    SpscQueue<Frame*> m_freeFrames{m_pipelineDepth};
+    SpscQueue<Frame*> m_decodedFrames{m_pipelineDepth};
+    // a decode task is queued or running
+    std::atomic<bool> m_decoding{false};
+    // set by the destructor, no further frames are decoded
+    std::atomic<bool> m_stopping{false};
+    // decode and measure tasks which are not finished
+    std::atomic<int> m_runningTasks{0};
+    // the last frame of the sensor was processed
+    bool m_finished = false;
+
+    // raycast of the global model, allocated once
+    SurfaceMap m_predictedFrame;
+    // pixels that get raycast for tracking: every m_predictionStride-th pixel in both directions
+    const uint m_predictionStride = 2;
+    std::vector<uint> m_predictedPixels;
+    // coarse to fine tracking on the measured pyramid: each level uses every m_trackingStride-th pixel of its
+    // pyramid level in both directions, m_trackingIterations holds the iterations per level, starting with the finest
+    const uint m_trackingStride = 2;
+    const std::vector<int> m_trackingIterations = {2, 3, 5};
+    // sampling of the strided points of each level. stays at Stride: on the test sequences normal space sampling
+    // (4096 points) has ~4x the pose error for ~40% less tracking time, covariance sampling costs more than it saves
+    const SamplingMethod m_trackingSampling = SamplingMethod::Stride;
+    const size_t m_trackingBudget = 4096;
 
 
     Matrix4f m_CamToWorld;
+    // initial guess for tracking and pose of the raycast, from the motion of the last frames
+    PosePredictor m_posePredictor;
     std::vector<Matrix4f> m_currentPose;
     std::vector<Matrix4f> m_currentPoseGroundTruth;
     const Matrix4f m_refPoseGroundTruth;
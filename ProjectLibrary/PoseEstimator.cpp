@@ -2,14 +2,29 @@
 #include "StopWatch.h"
 
 
-void PoseEstimator::setTarget(PointCloud& input)
+void PoseEstimator::setTarget(const PointCloud& input)
 {
     m_target = input;
+    m_targetChanged = true;
 }
 
-void PoseEstimator::setSource(PointCloud& input)
+void PoseEstimator::setTarget(PointCloud&& input)
 {
-    m_source = input;
+    // the memory of the previous target goes back to the caller
+    std::swap(m_target, input);
+    m_targetChanged = true;
+}
+
+void PoseEstimator::setSource(const PointCloud& input)
+{
+    m_source.resize(1);
+    m_source[0] = input;
+}
+
+void PoseEstimator::setSource(PointCloud&& input)
+{
+    m_source.resize(1);
+    std::swap(m_source[0], input);
 }
 
 void PoseEstimator::setTarget(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals)
@@ -17,9 +32,15 @@ void PoseEstimator::setTarget(const std::vector<Vector3f>& points, const std::ve
     m_target.points = points;
     m_target.normals = normals;
 
-    m_target.normalsValid = std::vector<bool>(normals.size(), true);
-    m_target.pointsValid = std::vector<bool>(points.size(), true);
+    m_target.normalsValid.assign(normals.size(), true);
+    m_target.pointsValid.assign(points.size(), true);
+    m_targetChanged = true;
+}
 
+void PoseEstimator::setTarget(const SurfaceMap& input, const Matrix4f&, unsigned int)
+{
+    input.compact(m_target);
+    m_targetChanged = true;
 }
 
 void PoseEstimator::setSource(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals)
@@ -29,30 +50,472 @@ void PoseEstimator::setSource(const std::vector<Vector3f>& points, const std::ve
 
 void PoseEstimator::setSource(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals, unsigned int downsample)
 {
+    m_source.resize(1);
+    PointCloud& source = m_source[0];
     if (downsample == 1)
     {
-        m_source.points = points;
-        m_source.normals = normals;
+        source.points = points;
+        source.normals = normals;
 
-        m_source.normalsValid = std::vector<bool>(normals.size(), true);
-        m_source.pointsValid = std::vector<bool>(points.size(), true);
+        source.normalsValid.assign(normals.size(), true);
+        source.pointsValid.assign(points.size(), true);
     }
     else
     {
         size_t nPoints = std::min(points.size(), normals.size()) / downsample;
-        m_source.points = std::vector<Vector3f>(nPoints);
-        m_source.normals = std::vector<Vector3f>(nPoints);
+        source.points = std::vector<Vector3f>(nPoints);
+        source.normals = std::vector<Vector3f>(nPoints);
         for (size_t i = 0; i < nPoints; ++i)
         {
-            m_source.points[i] = points[i*downsample];
-            m_source.normals[i] = normals[i*downsample];
+            source.points[i] = points[i*downsample];
+            source.normals[i] = normals[i*downsample];
         }
 
-        m_source.normalsValid = std::vector<bool>(nPoints, true);
-        m_source.pointsValid = std::vector<bool>(nPoints, true);
+        source.normalsValid.assign(nPoints, true);
+        source.pointsValid.assign(nPoints, true);
     }
 }
 
+void PoseEstimator::setSourcePyramid(const PointCloud& input, unsigned int height, unsigned int width, unsigned int stride)
+{
+    ASSERT_NDBG(input.points.size() == height*width);
+
+    m_source.resize(m_nIter.size());
+    for (size_t level = 0; level < m_source.size(); ++level)
+    {
+        setSourceLevel(level, input, height, width, stride << level);
+    }
+}
+
+void PoseEstimator::setSourcePyramid(const std::vector<SurfaceMap>& input, unsigned int stride)
+{
+    ASSERT_NDBG(!input.empty());
+
+    m_source.resize(m_nIter.size());
+    for (size_t level = 0; level < m_source.size(); ++level)
+    {
+        // levels beyond the input pyramid take fewer pixels of its coarsest level
+        const size_t inputLevel = std::min(level, input.size() - 1);
+        const SurfaceMap& surfaceMap = input[inputLevel];
+        setSourceLevel(level, surfaceMap, surfaceMap.height(), surfaceMap.width(), stride << (level - inputLevel));
+    }
+}
+
+// uniform access to the organized inputs of setSourceLevel
+static bool isValid(const PointCloud& input, size_t idx)
+{
+    return input.pointsValid[idx] && input.normalsValid[idx];
+}
+
+static Vector3f getPoint(const PointCloud& input, size_t idx)
+{
+    return input.points[idx];
+}
+
+static Vector3f getNormal(const PointCloud& input, size_t idx)
+{
+    return input.normals[idx];
+}
+
+static bool isValid(const SurfaceMap& input, size_t idx)
+{
+    return input.valid(idx);
+}
+
+static Vector3f getPoint(const SurfaceMap& input, size_t idx)
+{
+    return input.point(idx);
+}
+
+static Vector3f getNormal(const SurfaceMap& input, size_t idx)
+{
+    return input.normal(idx);
+}
+
+template<typename Organized>
+void PoseEstimator::setSourceLevel(size_t level, const Organized& input, unsigned int height, unsigned int width, unsigned int stride)
+{
+    PointCloud& source = m_source[level];
+
+    // entry k of the strided grid is pixel (stride*(k / columns), stride*(k % columns))
+    const size_t rows = (height + stride - 1) / stride;
+    const size_t columns = (width + stride - 1) / stride;
+    auto pixel = [&](size_t k) { return (k / columns) * stride * width + (k % columns) * stride; };
+    compactIndices(rows * columns,
+                   [&](size_t k) { return isValid(input, pixel(k)); },
+                   [&](size_t n) { source.points.resize(n); source.normals.resize(n); },
+                   [&](size_t k, size_t j) { source.points[j] = getPoint(input, pixel(k)); source.normals[j] = getNormal(input, pixel(k)); });
+
+    if (m_sampling != SamplingMethod::Stride && m_samplingBudget < source.points.size())
+    {
+        const std::vector<size_t>& samples = m_sampling == SamplingMethod::NormalSpace ?
+                    sampleNormalSpace(source.normals, m_samplingBudget) :
+                    sampleCovariance(source.points, source.normals, m_samplingBudget);
+        // ascending, so the points can be moved to the front in place
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            source.points[i] = source.points[samples[i]];
+            source.normals[i] = source.normals[samples[i]];
+        }
+        source.points.resize(samples.size());
+        source.normals.resize(samples.size());
+    }
+
+    source.pointsValid.assign(source.points.size(), true);
+    source.normalsValid.assign(source.normals.size(), true);
+}
+
+void PoseEstimator::setSampling(SamplingMethod method, size_t budget)
+{
+    ASSERT_NDBG(budget > 0);
+    m_sampling = method;
+    m_samplingBudget = budget;
+}
+
+const std::vector<size_t>& PoseEstimator::sampleNormalSpace(const std::vector<Vector3f>& normals, size_t budget)
+{
+    const size_t nPoints = normals.size();
+    m_samples.resize(std::min(nPoints, budget));
+    if (budget >= nPoints)
+    {
+        std::iota(m_samples.begin(), m_samples.end(), 0);
+        return m_samples;
+    }
+
+    // buckets: each normal component quantized into 4 intervals of [-1, 1]
+    const int nIntervals = 4;
+    const size_t nBuckets = nIntervals * nIntervals * nIntervals;
+    auto quantize = [](float value) { return std::min(nIntervals - 1, std::max(0, static_cast<int>((value + 1.f) * 0.5f * nIntervals))); };
+    m_bucketOf.resize(nPoints);
+    ThreadPool::global().parallelFor(nPoints, [&](size_t i)
+    {
+        const Vector3f& n = normals[i];
+        m_bucketOf[i] = static_cast<unsigned char>((quantize(n.x()) * nIntervals + quantize(n.y())) * nIntervals + quantize(n.z()));
+    });
+
+    // counting sort by bucket, ascending within a bucket
+    m_bucketStart.assign(nBuckets + 1, 0);
+    for (size_t i = 0; i < nPoints; ++i)
+    {
+        ++m_bucketStart[m_bucketOf[i] + 1];
+    }
+    for (size_t bucket = 0; bucket < nBuckets; ++bucket)
+    {
+        m_bucketStart[bucket + 1] += m_bucketStart[bucket];
+    }
+    m_bucketOrder.resize(nPoints);
+    for (size_t i = 0; i < nPoints; ++i)
+    {
+        m_bucketOrder[m_bucketStart[m_bucketOf[i]]++] = i;
+    }
+    // the scatter moved each start to the end of its bucket
+    for (size_t bucket = nBuckets; bucket > 0; --bucket)
+    {
+        m_bucketStart[bucket] = m_bucketStart[bucket - 1];
+    }
+    m_bucketStart[0] = 0;
+
+    // one point of every bucket in turn: rounds full rounds take min(size, rounds) of each bucket,
+    // the remaining points go to the first buckets with points left
+    auto taken = [&](size_t rounds)
+    {
+        size_t n = 0;
+        for (size_t bucket = 0; bucket < nBuckets; ++bucket)
+        {
+            n += std::min(m_bucketStart[bucket + 1] - m_bucketStart[bucket], rounds);
+        }
+        return n;
+    };
+    size_t low = 0, high = budget;
+    while (low < high)
+    {
+        const size_t rounds = (low + high + 1) / 2;
+        if (taken(rounds) <= budget)
+        {
+            low = rounds;
+        }
+        else
+        {
+            high = rounds - 1;
+        }
+    }
+    size_t remaining = budget - taken(low);
+
+    // random points of each bucket, fixed seed for reproducible tracking
+    std::mt19937 generator(0);
+    size_t nSamples = 0;
+    for (size_t bucket = 0; bucket < nBuckets; ++bucket)
+    {
+        const size_t begin = m_bucketStart[bucket];
+        const size_t size = m_bucketStart[bucket + 1] - begin;
+        size_t quota = std::min(size, low);
+        if (quota < size && remaining > 0)
+        {
+            ++quota;
+            --remaining;
+        }
+        // partial Fisher-Yates shuffle of the first quota points
+        for (size_t i = 0; i < quota; ++i)
+        {
+            std::uniform_int_distribution<size_t> pick(i, size - 1);
+            std::swap(m_bucketOrder[begin + i], m_bucketOrder[begin + pick(generator)]);
+            m_samples[nSamples++] = m_bucketOrder[begin + i];
+        }
+    }
+
+    std::sort(m_samples.begin(), m_samples.end());
+    return m_samples;
+}
+
+const std::vector<size_t>& PoseEstimator::sampleCovariance(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals, size_t budget)
+{
+    const size_t nPoints = points.size();
+    m_samples.clear();
+    if (budget >= nPoints)
+    {
+        m_samples.resize(nPoints);
+        std::iota(m_samples.begin(), m_samples.end(), 0);
+        return m_samples;
+    }
+
+    // centered and scaled, so rotations and translations are comparable
+    Vector3f centroid = Vector3f::Zero();
+    for (const auto& point : points)
+    {
+        centroid += point;
+    }
+    centroid /= nPoints;
+    float scale = 0;
+    for (const auto& point : points)
+    {
+        scale += (point - centroid).norm();
+    }
+    scale = std::max(scale / nPoints, 1e-6f);
+
+    // constraint of each point on the motion x: v^T x with v = ((p - c) / scale x n, n)
+    m_constraints.resize(nPoints);
+    const NormalEquations covariance = NormalEquations::accumulate(nPoints, [&](size_t i, NormalEquations& local)
+    {
+        m_constraints[i] << ((points[i] - centroid) / scale).cross(normals[i]), normals[i];
+        local.JTJ += (m_constraints[i] * m_constraints[i].transpose()).cast<double>();
+    });
+    const SelfAdjointEigenSolver<Matrix<double, 6, 6>> eigenSolver(covariance.JTJ);
+    const Matrix<float, 6, 6> eigenvectors = eigenSolver.eigenvectors().cast<float>();
+
+    ThreadPool& pool = ThreadPool::global();
+    // strength of point i along eigenvector k at k*nPoints + i, contiguous for the selection
+    m_strengths.resize(6 * nPoints);
+    pool.parallelFor(nPoints, [&](size_t i)
+    {
+        const Matrix<float, 6, 1> strength = (eigenvectors.transpose() * m_constraints[i]).cwiseAbs2();
+        for (size_t k = 0; k < 6; ++k)
+        {
+            m_strengths[k * nPoints + i] = strength[k];
+        }
+    });
+
+    // per eigenvector: the budget points with the largest constraint along it, strongest first.
+    // the threshold is selected on a copy of the strengths, which is faster than selecting indices
+    m_selection.resize(6 * nPoints);
+    m_candidates.resize(6 * budget);
+    pool.parallelFor(6, [&](size_t k)
+    {
+        const float* strength = &m_strengths[k * nPoints];
+        float* selection = &m_selection[k * nPoints];
+        std::copy(strength, strength + nPoints, selection);
+        std::nth_element(selection, selection + budget - 1, selection + nPoints, std::greater<float>());
+        const float threshold = selection[budget - 1];
+
+        size_t* candidates = &m_candidates[k * budget];
+        size_t nCandidates = 0;
+        for (size_t i = 0; i < nPoints; ++i)
+        {
+            if (strength[i] > threshold)
+            {
+                candidates[nCandidates++] = i;
+            }
+        }
+        for (size_t i = 0; i < nPoints && nCandidates < budget; ++i)
+        {
+            if (strength[i] == threshold)
+            {
+                candidates[nCandidates++] = i;
+            }
+        }
+        std::sort(candidates, candidates + budget, [&](size_t a, size_t b)
+        {
+            return strength[a] > strength[b] || (strength[a] == strength[b] && a < b);
+        });
+    });
+
+    // always add a point to the eigenvector which is constrained least so far
+    m_taken.assign(nPoints, false);
+    size_t next[6] = {0, 0, 0, 0, 0, 0};
+    Matrix<float, 6, 1> constrained = Matrix<float, 6, 1>::Zero();
+    m_samples.reserve(budget);
+    while (m_samples.size() < budget)
+    {
+        int k;
+        constrained.minCoeff(&k);
+
+        const size_t* candidates = &m_candidates[k * budget];
+        size_t& position = next[k];
+        while (position < budget && m_taken[candidates[position]])
+        {
+            ++position;
+        }
+        if (position == budget)
+        {
+            // exhausted, do not pick this direction again
+            constrained[k] = std::numeric_limits<float>::max();
+            continue;
+        }
+
+        const size_t i = candidates[position];
+        m_taken[i] = true;
+        m_samples.push_back(i);
+        for (int j = 0; j < 6; ++j)
+        {
+            if (constrained[j] < std::numeric_limits<float>::max())
+            {
+                constrained[j] += m_strengths[j * nPoints + i];
+            }
+        }
+    }
+
+    std::sort(m_samples.begin(), m_samples.end());
+    return m_samples;
+}
+
+void PoseEstimator::setIterations(const std::vector<int>& iterationsPerLevel)
+{
+    ASSERT_NDBG(!iterationsPerLevel.empty());
+    m_nIter = iterationsPerLevel;
+}
+
+void PoseEstimator::setConvergenceCriteria(const ConvergenceCriteria& criteria)
+{
+    m_criteria = criteria;
+}
+
+void PoseEstimator::setRobustKernel(RobustKernel kernel, float minThreshold)
+{
+    ASSERT_NDBG(minThreshold > 0);
+    m_robustKernel = kernel;
+    m_minRobustThreshold = minThreshold;
+}
+
+void PoseEstimator::setDepthWeighting(bool enable)
+{
+    m_depthWeighting = enable;
+}
+
+float PoseEstimator::weight(size_t i, float residual, float depth)
+{
+    float weight = 1.f;
+    if (m_depthWeighting)
+    {
+        // axial noise of the kinect sigma(z) = 0.0012 + 0.0019 (z - 0.4)^2, relative to its minimum at 0.4 m.
+        // see also: C. Nguyen et al. "Modeling Kinect Sensor Noise for Improved 3D Reconstruction and Tracking" 2012
+        const float dz = std::max(depth - 0.4f, 0.f);
+        const float ratio = 0.0012f / (0.0012f + 0.0019f * dz * dz);
+        weight = ratio * ratio;
+    }
+
+    if (m_robustKernel == RobustKernel::None)
+    {
+        return weight;
+    }
+
+    const float r = std::abs(residual);
+    m_residuals[i] = r;
+    const float k = m_robustThreshold;
+    if (m_robustKernel == RobustKernel::Huber)
+    {
+        return r > k ? weight * k / r : weight;
+    }
+    if (r >= k)
+    {
+        return 0.f;
+    }
+    const float u = 1.f - (r / k) * (r / k);
+    return weight * u * u;
+}
+
+void PoseEstimator::resetResiduals(size_t nPoints)
+{
+    if (m_robustKernel != RobustKernel::None)
+    {
+        m_residuals.assign(nPoints, -1.f);
+    }
+}
+
+void PoseEstimator::updateRobustThreshold()
+{
+    if (m_robustKernel == RobustKernel::None)
+    {
+        return;
+    }
+
+    m_sortedResiduals.clear();
+    for (float residual : m_residuals)
+    {
+        if (residual >= 0)
+        {
+            m_sortedResiduals.push_back(residual);
+        }
+    }
+    if (m_sortedResiduals.empty())
+    {
+        return;
+    }
+
+    // standard deviation estimated from the median absolute residual, scaled by the tuning constant of the
+    // kernel for 95% efficiency on gaussian noise
+    auto median = m_sortedResiduals.begin() + m_sortedResiduals.size() / 2;
+    std::nth_element(m_sortedResiduals.begin(), median, m_sortedResiduals.end());
+    const float sigma = 1.4826f * *median;
+    const float tuning = m_robustKernel == RobustKernel::Huber ? 1.345f : 4.685f;
+    m_robustThreshold = std::max(tuning * sigma, m_minRobustThreshold);
+}
+
+bool PoseEstimator::update(int level, size_t nSourcePoints, size_t nInliers, const NormalEquations& equations, Clock::time_point start, Matrix4f& estimatedPose)
+{
+    IcpIteration iteration;
+    iteration.level = level;
+    iteration.nSourcePoints = nSourcePoints;
+    iteration.nInliers = nInliers;
+    iteration.error = equations.nConstraints ? std::sqrt(equations.squaredError / equations.nConstraints) : 0.f;
+
+    bool converged = false;
+    // need at least 6 constraints
+    if (equations.nConstraints < 6 || nInliers < m_criteria.minInlierRatio * nSourcePoints)
+    {
+        iteration.rejected = true;
+        converged = true;
+    }
+    else
+    {
+        const Matrix4f poseUpdate = equations.solve();
+        estimatedPose = poseUpdate * estimatedPose;
+
+        iteration.translation = poseUpdate.block<3,1>(0,3).norm();
+        iteration.rotation = AngleAxisf(Matrix3f(poseUpdate.block<3,3>(0,0))).angle();
+        converged = iteration.translation < m_criteria.minTranslation && iteration.rotation < m_criteria.minRotation;
+
+        if (!m_iterations.empty() && m_iterations.back().level == level)
+        {
+            const float previousError = m_iterations.back().error;
+            converged |= std::abs(previousError - iteration.error) <= m_criteria.minErrorChange * previousError;
+        }
+    }
+
+    iteration.time = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+    m_iterations.push_back(iteration);
+
+    return converged || budgetExhausted();
+}
+
 void PoseEstimator::printPoints()
 {
     std::cout << "first 10 points " << std::endl;
@@ -83,106 +546,158 @@ std::vector<Vector3f> PoseEstimator::transformNormal(const std::vector<Vector3f>
     std::vector<Vector3f> output;
     output.reserve(input.size());
 
-    const auto rotation = pose.block(0, 0, 3, 3);
+    const Matrix3f normalTransform = pose.block<3,3>(0,0).inverse().transpose();
 
     for (const auto& normal : input)
     {
-        output.push_back(rotation.inverse().transpose() * normal);
+        output.push_back(normalTransform * normal);
     }
 
     return output;
 }
 
 NearestNeighborPoseEstimator::NearestNeighborPoseEstimator()
-{}
+    : m_nearestNeighborSearch(std::make_unique<NearestNeighborSearchKdTree>())
+{
+    m_nearestNeighborSearch->setMatchingMaxDistance(m_maxDistance);
+}
 
 Matrix4f NearestNeighborPoseEstimator::estimatePose(Matrix4f initialPose)
 {
-    m_nearestNeighborSearch = std::make_unique<NearestNeighborSearchFlann>();
-    // Build the index of the FLANN tree (for fast nearest neighbor lookup).
-    m_nearestNeighborSearch->buildIndex(m_target.points);
+    // Build the kd-tree (for fast nearest neighbor lookup), it is kept until the target changes.
+    // the target of the next frame is close to the last one, so the index is refit to it if possible
+    if (m_targetChanged)
+    {
+        m_nearestNeighborSearch->updateIndex(m_target.points);
+        m_targetChanged = false;
+    }
 
     // The initial estimate can be given as an argument.
     Matrix4f estimatedPose = initialPose;
 
-    for (int i = 0; i < m_nIter; ++i)
-    {
-        auto transformedPoints = transformPoint(m_source.points, estimatedPose);
-        auto transformedNormals = transformNormal(m_source.normals, estimatedPose);
-        auto matches = m_nearestNeighborSearch->queryMatches(transformedPoints);
-
-        pruneCorrespondences(transformedNormals, m_target.normals, matches);
+    m_iterations.clear();
+    m_robustThreshold = FLT_MAX;
 
-        std::vector<Vector3f> sourcePoints;
-        std::vector<Vector3f> targetPoints;
+    // coarse to fine
+    for (int level = m_source.size() - 1; level >= 0 && !budgetExhausted(); --level)
+    {
+        const PointCloud& source = m_source[level];
+        const size_t nPoints = source.points.size();
+        m_nearestNeighbors.assign(nPoints, Match{ -1, 0.f });
 
-        // Add all matches to the sourcePoints and targetPoints vectors,
-        // so that sourcePoints[i] matches targetPoints[i].
-        for (size_t j = 0; j < transformedPoints.size(); j++)
+        for (int i = 0; i < iterations(level); ++i)
         {
-            const auto& match = matches[j];
-            if (match.idx >= 0)
+            const auto start = Clock::now();
+            resetResiduals(nPoints);
+            // rigid transformation: normals are rotated like the points
+            const Matrix3f rotation = estimatedPose.block<3,3>(0,0);
+            const Vector3f translation = estimatedPose.block<3,1>(0,3);
+
+            // transform, match, reject and accumulate in one pass
+            const NormalEquations equations = NormalEquations::accumulate(nPoints,
+                [&](size_t j, NormalEquations& local)
+                {
+                    const Vector3f point = rotation * source.points[j] + translation;
+                    Match& match = m_nearestNeighbors[j];
+                    match = m_nearestNeighborSearch->queryMatch(point, match.idx);
+                    if (match.idx < 0)
+                    {
+                        return;
+                    }
+
+                    const Vector3f& targetNormal = m_target.normals[match.idx];
+                    if ((rotation * source.normals[j]).dot(targetNormal) < m_minNormalCos)
+                    {
+                        return;
+                    }
+
+                    const Vector3f& targetPoint = m_target.points[match.idx];
+                    match.weight = weight(j, targetNormal.dot(targetPoint - point), source.points[j].z());
+                    if (match.weight <= 0)
+                    {
+                        return;
+                    }
+                    local.addPointToPlane(point, targetPoint, targetNormal, match.weight);
+                    local.addPointToPoint(point, targetPoint, match.weight);
+                    ++local.nCorrespondences;
+                },
+                m_partialEquations);
+            updateRobustThreshold();
+
+            if (update(level, nPoints, equations.nCorrespondences, equations, start, estimatedPose))
             {
-                sourcePoints.push_back(transformedPoints[j]);
-                targetPoints.push_back(m_target.points[match.idx]);
+                break;
             }
         }
-
-        // need at least 3 points
-        ASSERT_NDBG(sourcePoints.size() >= 3);
-        estimatedPose = solvePointToPlane(sourcePoints, targetPoints, m_target.normals) * estimatedPose;
     }
 
-    m_nearestNeighborSearch.reset();
     return estimatedPose;
 
 }
 
-Matrix4f NearestNeighborPoseEstimator::solvePointToPlane(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals)
+Matrix4f PoseEstimator::solvePointToPlane(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals, bool pointToPoint)
 {
-    const size_t nPoints = sourcePoints.size();
-
-    // Build the system
-    MatrixXf A = MatrixXf::Zero(4 * nPoints, 6);
-    VectorXf b = VectorXf::Zero(4 * nPoints);
-
-    for (size_t i = 0; i < nPoints; i++)
-    {
-        const auto& s = sourcePoints[i];
-        const auto& d = targetPoints[i];
-        const auto& n = targetNormals[i];
-
-        // Add the point-to-plane constraints to the system
-        b[i] = n.dot(d) - n.dot(s);
-        A.block<1,3>(i,0) << n[2]*s[1] - n[1]*s[2],
-                             n[0]*s[2] - n[2]*s[0],
-                             n[1]*s[0] - n[0]*s[1];
-        A.block<1,3>(i,3) = n;
-        // Add the point-to-point constraints to the system
-        // for x-coords
-        b[nPoints+i] = d[0] - s[0];
-        A.block<1,6>(nPoints+i,0) << 0, s[2], -s[1], 1, 0, 0;
-
-        // for y-coords
-        b[2*nPoints+i] = d[1] - s[1];
-        A.block<1,6>(2*nPoints+i,0) << -s[2], 0, s[0], 0, 1, 0;
+    return pointToPlaneEquations(sourcePoints, targetPoints, targetNormals, pointToPoint).solve();
+}
 
-        // for z-coords
-        b[3*nPoints+i] = d[2] - s[2];
-        A.block<1,6>(3*nPoints+i,0) << s[1], -s[0], 0, 0, 0, 1;
-    }
+NormalEquations PoseEstimator::pointToPlaneEquations(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals, bool pointToPoint)
+{
+    return NormalEquations::accumulate(sourcePoints.size(),
+        [&](size_t i, NormalEquations& local)
+        {
+            local.addPointToPlane(sourcePoints[i], targetPoints[i], targetNormals[i]);
+            if (pointToPoint)
+            {
+                local.addPointToPoint(sourcePoints[i], targetPoints[i]);
+            }
+            ++local.nCorrespondences;
+        });
+}
 
-    // Solve the system
-    VectorXf x(6);
-    JacobiSVD<MatrixXf> svd(A, ComputeThinU | ComputeThinV);
+void NormalEquations::addPointToPlane(const Vector3f& s, const Vector3f& d, const Vector3f& n, float weight)
+{
+    Matrix<double, 6, 1> J;
+    J << n[2]*s[1] - n[1]*s[2],
+         n[0]*s[2] - n[2]*s[0],
+         n[1]*s[0] - n[0]*s[1],
+         n[0], n[1], n[2];
+    const double r = n.dot(d) - n.dot(s);
+
+    JTJ.selfadjointView<Upper>().rankUpdate(J, weight);
+    JTr += weight * r * J;
+    squaredError += weight * r * r;
+    ++nConstraints;
+}
 
-    x = svd.solve(b);
+void NormalEquations::addPointToPoint(const Vector3f& s, const Vector3f& d, float weight)
+{
+    // rows of J for x, y and z coordinates: [s]_x^T | I
+    Matrix<double, 3, 6> J;
+    J << 0, s[2], -s[1], 1, 0, 0,
+         -s[2], 0, s[0], 0, 1, 0,
+         s[1], -s[0], 0, 0, 0, 1;
+    const Vector3d r = (d - s).cast<double>();
+
+    JTJ.selfadjointView<Upper>().rankUpdate(J.transpose(), weight);
+    JTr += weight * J.transpose() * r;
+    squaredError += weight * r.squaredNorm();
+    nConstraints += 3;
+}
 
-    // TODO: constraint watching d/(d n_iter) MSE and adjusting n_iter if necessary
-    // residuals
-    ArrayXf res = (b - A * x).array();
-    // std::cout << "avg MSE per eqn: " << (res.abs().square().sum()) / (4*nPoints) << std::endl;
+NormalEquations& NormalEquations::operator+=(const NormalEquations& other)
+{
+    JTJ += other.JTJ;
+    JTr += other.JTr;
+    squaredError += other.squaredError;
+    nConstraints += other.nConstraints;
+    nCorrespondences += other.nCorrespondences;
+    return *this;
+}
 
+Matrix4f NormalEquations::solve() const
+{
+    // only the upper triangle of JTJ is accumulated
+    const Matrix<double, 6, 1> x = JTJ.selfadjointView<Upper>().ldlt().solve(JTr);
 
     float alpha = x(0), beta = x(1), gamma = x(2);
 
@@ -191,7 +706,7 @@ Matrix4f NearestNeighborPoseEstimator::solvePointToPlane(const std::vector<Vecto
                         AngleAxisf(beta, Vector3f::UnitY()).toRotationMatrix() *
                         AngleAxisf(gamma, Vector3f::UnitZ()).toRotationMatrix();
 
-    Vector3f translation = x.tail(3);
+    Vector3f translation = x.tail(3).cast<float>();
 
     // Build the pose matrix using the rotation and translation matrices
     Matrix4f estimatedPose = Matrix4f::Identity();
@@ -201,24 +716,100 @@ Matrix4f NearestNeighborPoseEstimator::solvePointToPlane(const std::vector<Vecto
     return estimatedPose;
 }
 
-void NearestNeighborPoseEstimator::pruneCorrespondences(const std::vector<Vector3f>& sourceNormals, const std::vector<Vector3f>& targetNormals, std::vector<Match>& matches)
+ProjectivePoseEstimator::ProjectivePoseEstimator(Matrix3f cameraIntrinsics)
+    : m_cameraIntrinsics(cameraIntrinsics)
+{}
+
+void ProjectivePoseEstimator::setTarget(const SurfaceMap& input, const Matrix4f& targetPose, unsigned int stride)
 {
-    const size_t nPoints = sourceNormals.size();
+    m_targetMap = &input;
+    m_targetPose = targetPose;
+    m_targetStride = stride;
+}
 
-    for (size_t i = 0; i < nPoints; ++i)
+Matrix4f ProjectivePoseEstimator::estimatePose(Matrix4f initialPose)
+{
+    ASSERT_NDBG(m_targetMap);
+    const SurfaceMap& target = *m_targetMap;
+
+    // intrinsics of the (possibly subsampled) target image
+    const float fovX = m_cameraIntrinsics(0, 0) / m_targetStride;
+    const float fovY = m_cameraIntrinsics(1, 1) / m_targetStride;
+    const float cX = m_cameraIntrinsics(0, 2) / m_targetStride;
+    const float cY = m_cameraIntrinsics(1, 2) / m_targetStride;
+    const int width = target.width();
+    const int height = target.height();
+
+    // world to target camera
+    const Matrix3f targetRotation = m_targetPose.block<3,3>(0,0).transpose();
+    const Vector3f targetTranslation = -targetRotation * m_targetPose.block<3,1>(0,3);
+
+    Matrix4f estimatedPose = initialPose;
+    m_iterations.clear();
+    m_robustThreshold = FLT_MAX;
+
+    // coarse to fine
+    for (int level = m_source.size() - 1; level >= 0 && !budgetExhausted(); --level)
     {
-        Match& match = matches[i];
-        if (match.idx >= 0)
+        const PointCloud& source = m_source[level];
+        const size_t nPoints = source.points.size();
+
+        for (int i = 0; i < iterations(level); ++i)
         {
-            const auto& sourceNormal = sourceNormals[i];
-            const auto& targetNormal = targetNormals[match.idx];
-            float angle = std::acos(sourceNormal.dot(targetNormal));
-            // larger than 60 deg
-            if(angle > 1.0472f)
+            const auto start = Clock::now();
+            resetResiduals(nPoints);
+            const Matrix3f rotation = estimatedPose.block<3,3>(0,0);
+            const Vector3f translation = estimatedPose.block<3,1>(0,3);
+
+            // associate, weight and accumulate in one pass
+            const NormalEquations equations = NormalEquations::accumulate(nPoints,
+                [&](size_t j, NormalEquations& local)
+                {
+                    const Vector3f point = rotation * source.points[j] + translation;
+                    const Vector3f normal = rotation * source.normals[j];
+
+                    // project into the target image
+                    const Vector3f cameraPoint = targetRotation * point + targetTranslation;
+                    if (cameraPoint.z() <= 0)
+                    {
+                        return;
+                    }
+                    const int u = std::lround(fovX * cameraPoint.x() / cameraPoint.z() + cX);
+                    const int v = std::lround(fovY * cameraPoint.y() / cameraPoint.z() + cY);
+                    if (u < 0 || u >= width || v < 0 || v >= height)
+                    {
+                        return;
+                    }
+
+                    const size_t idx = v*width + u;
+                    if (!target.valid(idx))
+                    {
+                        return;
+                    }
+                    const Vector3f targetPoint = target.point(idx);
+                    const Vector3f targetNormal = target.normal(idx);
+                    if ((targetPoint - point).norm() > m_maxDistance || targetNormal.dot(normal) < m_minNormalCos)
+                    {
+                        return;
+                    }
+
+                    const float w = weight(j, targetNormal.dot(targetPoint - point), source.points[j].z());
+                    if (w <= 0)
+                    {
+                        return;
+                    }
+                    local.addPointToPlane(point, targetPoint, targetNormal, w);
+                    ++local.nCorrespondences;
+                },
+                m_partialEquations);
+            updateRobustThreshold();
+
+            if (update(level, nPoints, equations.nCorrespondences, equations, start, estimatedPose))
             {
-                match.idx = -1;
+                break;
             }
         }
     }
-}
 
+    return estimatedPose;
+}
@@ -1,8 +1,133 @@
 #include <memory>
+#include <chrono>
+#include <cfloat>
+#include <numeric>
+#include <random>
+#include <functional>
 
 #include "Eigen.h"
 #include "DataTypes.h"
 #include "NearestNeighbor.h"
+#include "ThreadPool.h"
+
+// normal equations (J^T J) x = J^T r of the linearized alignment, x = (alpha, beta, gamma, t_x, t_y, t_z).
+// constraints are accumulated without storing J, so the system is 6x6 independent of the number of points.
+struct NormalEquations
+{
+    Matrix<double, 6, 6> JTJ = Matrix<double, 6, 6>::Zero();
+    Matrix<double, 6, 1> JTr = Matrix<double, 6, 1>::Zero();
+    // sum of the weighted squared residuals at x = 0
+    double squaredError = 0;
+    size_t nConstraints = 0;
+    // number of corresponding points, counted by the caller
+    size_t nCorrespondences = 0;
+
+    // distance of s to the plane through d with normal n
+    void addPointToPlane(const Vector3f& s, const Vector3f& d, const Vector3f& n, float weight = 1.f);
+    // distance of s to d in x, y and z
+    void addPointToPoint(const Vector3f& s, const Vector3f& d, float weight = 1.f);
+
+    NormalEquations& operator+=(const NormalEquations& other);
+
+    // solve (Cholesky/LDLT) and convert the solution into a pose increment
+    Matrix4f solve() const;
+
+    // accumulate addTerm(i, equations) for i in [0, n) in parallel: one system per block of indices, combined by a
+    // tree reduction. the blocks do not depend on the scheduling, so neither does the rounding of the result
+    template<typename AddTerm>
+    static NormalEquations accumulate(size_t n, AddTerm addTerm)
+    {
+        std::vector<NormalEquations> partial;
+        return accumulate(n, addTerm, partial);
+    }
+
+    // as above, partial holds the systems of the blocks and is reused between calls
+    template<typename AddTerm>
+    static NormalEquations accumulate(size_t n, AddTerm addTerm, std::vector<NormalEquations>& partial)
+    {
+        ThreadPool& pool = ThreadPool::global();
+        const size_t nBlocks = std::max<size_t>(1, std::min(n, blocksPerThread * (pool.size() + 1)));
+        partial.assign(nBlocks, NormalEquations());
+        pool.parallelFor(nBlocks, [&](size_t block)
+        {
+            NormalEquations& local = partial[block];
+            for (size_t i = block * n / nBlocks; i < (block + 1) * n / nBlocks; ++i)
+            {
+                addTerm(i, local);
+            }
+        });
+        for (size_t stride = 1; stride < partial.size(); stride *= 2)
+        {
+            for (size_t i = 0; i + stride < partial.size(); i += 2*stride)
+            {
+                partial[i] += partial[i + stride];
+            }
+        }
+        return partial[0];
+    }
+
+    // blocks of accumulate per thread, for load balancing
+    static constexpr size_t blocksPerThread = 4;
+};
+
+// stop iterating a pyramid level when the pose update or the change of the error gets small,
+// give up when too few source points have a correspondence
+struct ConvergenceCriteria
+{
+    // minimal translation of a pose update in m
+    float minTranslation = 1e-4f;
+    // minimal rotation angle of a pose update in rad
+    float minRotation = 1e-4f;
+    // minimal relative change of the rms error between two iterations
+    float minErrorChange = 1e-3f;
+    // minimal ratio of source points with correspondence
+    float minInlierRatio = 0.1f;
+    // maximal number of iterations over all pyramid levels
+    int maxIterations = 100;
+};
+
+// statistics of one ICP iteration
+struct IcpIteration
+{
+    int level = 0;
+    size_t nSourcePoints = 0;
+    size_t nInliers = 0;
+    // rms of the residuals before the update
+    float error = 0;
+    // size of the pose update
+    float translation = 0;
+    float rotation = 0;
+    // duration in ms
+    float time = 0;
+    // pose update not applied: too few inliers
+    bool rejected = false;
+};
+
+// selection of the source points on each pyramid level
+enum class SamplingMethod
+{
+    // every (stride*2^l)-th pixel
+    Stride,
+    // spread evenly over the normal directions.
+    // see also: S. Rusinkiewicz, M. Levoy "Efficient Variants of the ICP Algorithm" 2001
+    NormalSpace,
+    // points constraining the least constrained motions first.
+    // see also: N. Gelfand et al. "Geometrically Stable Sampling for the ICP Algorithm" 2003
+    Covariance
+};
+
+// weighting of the correspondences by their point-to-plane residual r, recomputed in every iteration
+// (iteratively reweighted least squares). the threshold k follows the spread of the residuals of the
+// previous iteration, the first iteration is least squares.
+enum class RobustKernel
+{
+    // least squares, all correspondences have weight 1
+    None,
+    // weight 1 for |r| <= k, k/|r| beyond
+    Huber,
+    // weight (1 - (r/k)^2)^2 for |r| < k, correspondences beyond are ignored
+    Tukey
+};
 
 // estimate a 4x4 transformation matrix 'pose',
 // which alignes PointCloud Source with PointCloud Target.
@@ -11,12 +136,42 @@ class PoseEstimator
 public:
     PoseEstimator(){}
 
-    void setTarget(PointCloud& input);
-    void setSource(PointCloud& input);
+    void setTarget(const PointCloud& input);
+    // takes the memory of input without copying, input is left with the previous target
+    void setTarget(PointCloud&& input);
+    void setSource(const PointCloud& input);
+    // takes the memory of input without copying, input is left with the previous source
+    void setSource(PointCloud&& input);
     void setTarget(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals);
+    // target predicted from the global model at targetPose (camera to world, as used by SurfacePredictor).
+    // input is organized: entry (v, u) belongs to pixel (stride*v, stride*u) of the camera image.
+    // by default only pixels with valid point and normal are taken, reusing the memory of the current target
+    virtual void setTarget(const SurfaceMap& input, const Matrix4f& targetPose, unsigned int stride);
     void setSource(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals);
     // for a downsample factor of n: only take every n-th point.
     void setSource(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals, unsigned int downsample);
+    // source for coarse to fine estimation from an organized PointCloud (height*width entries, unpruned).
+    // level l takes every (stride*2^l)-th pixel in both directions, with one level per entry of setIterations
+    void setSourcePyramid(const PointCloud& input, unsigned int height, unsigned int width, unsigned int stride);
+    // source from an image pyramid (e.g. of SurfaceMeasurer), level l takes every stride-th pixel of input[l]
+    // in both directions. levels beyond the pyramid stride its coarsest level further
+    void setSourcePyramid(const std::vector<SurfaceMap>& input, unsigned int stride);
+    // each pyramid level keeps at most budget of its strided points, picked by method
+    void setSampling(SamplingMethod method, size_t budget);
+    // number of iterations per pyramid level, level 0 is the finest.
+    // estimation starts at the coarsest level and refines the pose on the finer levels
+    void setIterations(const std::vector<int>& iterationsPerLevel);
+    // early termination, iterations per level are the upper bound
+    void setConvergenceCriteria(const ConvergenceCriteria& criteria);
+    // robust weighting of the correspondences, the threshold is at least minThreshold (in m)
+    void setRobustKernel(RobustKernel kernel, float minThreshold);
+    // weight the correspondences by the inverse variance of the depth noise at their source point
+    void setDepthWeighting(bool enable);
+    // statistics of all iterations of the last estimatePose
+    const std::vector<IcpIteration>& getIterations() const
+    {
+        return m_iterations;
+    }
     // debug method
     void printPoints();
     // estimate pose. optional argument: initial pose
@@ -24,11 +179,76 @@ public:
     // helper methods
     static std::vector<Vector3f> transformPoint(const std::vector<Vector3f>& input, const Matrix4f& pose);
     static std::vector<Vector3f> transformNormal(const std::vector<Vector3f>& input, const Matrix4f& pose);
+    // indices of budget points (all if there are fewer), sorted ascending. valid until the next sampling
+    const std::vector<size_t>& sampleNormalSpace(const std::vector<Vector3f>& normals, size_t budget);
+    const std::vector<size_t>& sampleCovariance(const std::vector<Vector3f>& points, const std::vector<Vector3f>& normals, size_t budget);
 
 protected:
+    // strided and sampled valid points of organized input (PointCloud or SurfaceMap) as source level
+    template<typename Organized>
+    void setSourceLevel(size_t level, const Organized& input, unsigned int height, unsigned int width, unsigned int stride);
+
+    // iterations on pyramid level
+    int iterations(size_t level) const
+    {
+        return m_nIter[std::min(level, m_nIter.size() - 1)];
+    }
+
+    // point-to-plane alignment of corresponding points, sourcePoints[i] belongs to targetPoints[i]
+    // optionally adds point-to-point constraints, which only help if the correspondences are close to exact
+    static Matrix4f solvePointToPlane(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals, bool pointToPoint = true);
+    static NormalEquations pointToPlaneEquations(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals, bool pointToPoint = true);
+
+    // weight of the correspondence of source point i with point-to-plane residual r, the source point is at the
+    // given depth in its camera. records the residual for the next threshold, 0 if the correspondence is to be ignored
+    float weight(size_t i, float residual, float depth);
+    // prepare the residuals for nPoints source points, call before each iteration
+    void resetResiduals(size_t nPoints);
+    // set the kernel threshold from the residuals of the last iteration
+    void updateRobustThreshold();
+
+    using Clock = std::chrono::high_resolution_clock;
+    // solve and apply the update of one iteration started at 'start' and record its statistics.
+    // returns true if the level has converged (or failed) and no further iteration should be done
+    bool update(int level, size_t nSourcePoints, size_t nInliers, const NormalEquations& equations, Clock::time_point start, Matrix4f& estimatedPose);
+    // the iteration budget of estimatePose is used up
+    bool budgetExhausted() const
+    {
+        return static_cast<int>(m_iterations.size()) >= m_criteria.maxIterations;
+    }
+
     PointCloud m_target;
-    PointCloud m_source;
-    int m_nIter = 10;
+    // set by setTarget, for estimators which keep data derived from the target
+    bool m_targetChanged = true;
+    // source points per pyramid level, level 0 is the finest
+    std::vector<PointCloud> m_source = std::vector<PointCloud>(1);
+    // iterations per pyramid level
+    std::vector<int> m_nIter = {10};
+    SamplingMethod m_sampling = SamplingMethod::Stride;
+    size_t m_samplingBudget = std::numeric_limits<size_t>::max();
+    // sampling buffers kept between levels and frames
+    std::vector<size_t> m_samples;
+    // normal space: bucket of each point, first entry of each bucket in m_bucketOrder, points sorted by bucket
+    std::vector<unsigned char> m_bucketOf;
+    std::vector<size_t> m_bucketStart;
+    std::vector<size_t> m_bucketOrder;
+    // covariance: constraint of each point, its strength along each eigenvector (and a copy for the selection),
+    // the strongest points per eigenvector
+    std::vector<Matrix<float, 6, 1>> m_constraints;
+    std::vector<float> m_strengths;
+    std::vector<float> m_selection;
+    std::vector<size_t> m_candidates;
+    std::vector<bool> m_taken;
+    RobustKernel m_robustKernel = RobustKernel::None;
+    float m_minRobustThreshold = 0.01f;
+    float m_robustThreshold = FLT_MAX;
+    bool m_depthWeighting = false;
+    // absolute residual of each source point in the current iteration, negative without correspondence
+    std::vector<float> m_residuals;
+    std::vector<float> m_sortedResiduals;
+
+    ConvergenceCriteria m_criteria;
+    std::vector<IcpIteration> m_iterations;
 };
 
 // see also: Kok-Lim Low "Linear Least-Squares Optimization for Point-to-Plane ICP Surface Registration"
@@ -40,8 +260,44 @@ public:
     virtual Matrix4f estimatePose(Matrix4f initialPose = Matrix4f::Identity()) override;
 
 private:
-    Matrix4f solvePointToPlane(const std::vector<Vector3f>& sourcePoints, const std::vector<Vector3f>& targetPoints, const std::vector<Vector3f>& targetNormals);
-    void pruneCorrespondences(const std::vector<Vector3f> &sourceNormals, const std::vector<Vector3f> &targetNormals, std::vector<Match> &matches);
-
     std::unique_ptr<NearestNeighborSearch> m_nearestNeighborSearch;
+
+    // maximal distance of corresponding points
+    float m_maxDistance = 0.07f;
+    // minimal cosine of the angle between corresponding normals (60 deg)
+    float m_minNormalCos = 0.5f;
+
+    // buffers kept between iterations and frames
+    // nearest neighbor of each source point in the last iteration, hint for the next one
+    std::vector<Match> m_nearestNeighbors;
+    std::vector<NormalEquations> m_partialEquations;
+};
+
+// projective data association: correspondences are found by projecting the source points into the
+// organized target (the predicted vertex and normal map) instead of a nearest neighbor search.
+// see also: R. Newcombe et al. "KinectFusion: Real-Time Dense Surface Mapping and Tracking" 2011
+class ProjectivePoseEstimator : public PoseEstimator
+{
+public:
+    ProjectivePoseEstimator(Matrix3f cameraIntrinsics);
+
+    using PoseEstimator::setTarget;
+    // keeps a reference to input, which has to stay valid until estimatePose returns
+    virtual void setTarget(const SurfaceMap& input, const Matrix4f& targetPose, unsigned int stride) override;
+
+    virtual Matrix4f estimatePose(Matrix4f initialPose = Matrix4f::Identity()) override;
+
+private:
+    Matrix3f m_cameraIntrinsics;
+
+    const SurfaceMap* m_targetMap = nullptr;
+    Matrix4f m_targetPose;
+    unsigned int m_targetStride = 1;
+
+    // maximal distance of corresponding points
+    float m_maxDistance = 0.1f;
+    // minimal cosine of the angle between corresponding normals (60 deg)
+    float m_minNormalCos = 0.5f;
+
+    std::vector<NormalEquations> m_partialEquations;
 };
@@ -0,0 +1,61 @@
+#include "PosePredictor.h"
+
+PosePredictor::PosePredictor(float damping)
+    : m_damping(damping)
+{
+    ASSERT_NDBG(damping >= 0 && damping <= 1);
+}
+
+void PosePredictor::addPose(const Matrix4f& pose)
+{
+    if (m_nPoses > 0)
+    {
+        m_velocity = m_lastPose.inverse() * pose;
+    }
+    m_lastPose = pose;
+    ++m_nPoses;
+}
+
+void PosePredictor::reset()
+{
+    m_nPoses = 0;
+    m_lastPose = Matrix4f::Identity();
+    m_velocity = Matrix4f::Identity();
+}
+
+Matrix4f PosePredictor::predict() const
+{
+    if (m_nPoses < 2)
+    {
+        return m_lastPose;
+    }
+    return m_lastPose * scale(m_velocity, m_damping);
+}
+
+// V = I + (1 - cos t) / t^2 W + (t - sin t) / t^3 W^2 relates the translation of a rigid motion to its twist
+static Matrix3f leftJacobian(const Vector3f& omega)
+{
+    const float angle = omega.norm();
+    Matrix3f W;
+    W << 0, -omega.z(), omega.y(),
+         omega.z(), 0, -omega.x(),
+         -omega.y(), omega.x(), 0;
+    if (angle < 1e-6f)
+    {
+        return Matrix3f::Identity() + 0.5f * W;
+    }
+    const float angle2 = angle * angle;
+    return Matrix3f::Identity() + (1 - std::cos(angle)) / angle2 * W + (angle - std::sin(angle)) / (angle2 * angle) * W * W;
+}
+
+Matrix4f PosePredictor::scale(const Matrix4f& motion, float alpha)
+{
+    const AngleAxisf rotation(Matrix3f(motion.block<3,3>(0,0)));
+    const Vector3f omega = rotation.angle() * rotation.axis();
+    const Vector3f u = leftJacobian(omega).inverse() * motion.block<3,1>(0,3);
+
+    Matrix4f scaled = Matrix4f::Identity();
+    scaled.block<3,3>(0,0) = AngleAxisf(alpha * rotation.angle(), rotation.axis()).toRotationMatrix();
+    scaled.block<3,1>(0,3) = leftJacobian(alpha * omega) * (alpha * u);
+    return scaled;
+}
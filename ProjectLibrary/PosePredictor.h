@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Eigen.h"
+#include "DataTypes.h"
+
+// predicts the next camera pose from the last two with a constant velocity in SE(3):
+// the relative motion between the last two poses is applied once more, scaled by a damping factor
+class PosePredictor
+{
+public:
+    // damping in [0, 1]: 1 keeps the full velocity, 0 predicts the last pose
+    PosePredictor(float damping = 1.f);
+
+    // pose of the latest frame, camera to world
+    void addPose(const Matrix4f& pose);
+    // forget the motion, e.g. after tracking was lost
+    void reset();
+
+    // identity without any pose, the last pose without a velocity
+    Matrix4f predict() const;
+
+    // exp(alpha * log(motion)) of a rigid motion
+    static Matrix4f scale(const Matrix4f& motion, float alpha);
+
+private:
+    float m_damping;
+
+    unsigned int m_nPoses = 0;
+    Matrix4f m_lastPose = Matrix4f::Identity();
+    // motion from the second last to the last pose in camera coordinates
+    Matrix4f m_velocity = Matrix4f::Identity();
+};
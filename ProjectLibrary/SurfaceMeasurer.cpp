@@ -1,15 +1,42 @@
 #include "SurfaceMeasurer.h"
 
-SurfaceMeasurer::SurfaceMeasurer(Eigen::Matrix3f DepthIntrinsics, uint DepthImageHeight, uint DepthImageWidth)
+SurfaceMeasurer::SurfaceMeasurer(Eigen::Matrix3f DepthIntrinsics, uint DepthImageHeight, uint DepthImageWidth, uint nLevels)
     : m_DepthIntrinsics(DepthIntrinsics),
       m_DepthImageHeight(DepthImageHeight),
       m_DepthImageWidth(DepthImageWidth),
-      m_pointCloud(DepthImageHeight*DepthImageWidth)
-{}
+      // depth differences above 3 sigma (9 cm) are treated as discontinuities
+      m_filter(DepthImageWidth, DepthImageHeight, 0.03f),
+      m_levels(nLevels),
+      m_surfaceMaps(nLevels)
+{
+    ASSERT_NDBG(nLevels > 0);
+    for (size_t l = 0; l < m_levels.size(); ++l)
+    {
+        Level& level = m_levels[l];
+        if (l == 0)
+        {
+            level.height = DepthImageHeight;
+            level.width = DepthImageWidth;
+            level.intrinsics = DepthIntrinsics;
+        }
+        else
+        {
+            // pixel (x, y) is the center of the block (2x, 2y) to (2x+1, 2y+1) of the finer level
+            const Level& fine = m_levels[l - 1];
+            level.height = fine.height / 2;
+            level.width = fine.width / 2;
+            level.intrinsics = fine.intrinsics;
+            level.intrinsics.block<2,2>(0,0) /= 2;
+            level.intrinsics.block<2,1>(0,2) = (fine.intrinsics.block<2,1>(0,2) - Vector2f::Constant(0.5f)) / 2;
+        }
+        level.depth.resize(level.height * level.width);
+        m_surfaceMaps[l].resize(level.height, level.width);
+    }
+}
 
-void SurfaceMeasurer::registerInput(float* depthMap)
+void SurfaceMeasurer::registerInput(const float* depthMap)
 {
-    m_rawDepthMap = depthMap;
+    m_inputDepthMap = depthMap;
 }
 
 /*
@@ -30,96 +57,134 @@ void SurfaceMeasurer::smoothInput()
 void SurfaceMeasurer::smoothInput()
 { 
     //StopWatch watch("manual filtering");
-    auto filter = BilateralFilter<5,5>(m_DepthImageWidth, m_DepthImageHeight);
-    filter.apply(m_rawDepthMap);
+    m_filter.apply(getRawDepth(), m_levels[0].depth.data());
 }
 
 void SurfaceMeasurer::saveDepthMap(std::string filename)
 {
     FreeImage image(m_DepthImageWidth, m_DepthImageHeight, 1);
-    std::copy(m_rawDepthMap, m_rawDepthMap + m_DepthImageHeight*m_DepthImageWidth, image.data);
+    std::copy(m_levels[0].depth.begin(), m_levels[0].depth.end(), image.data);
     image.normalize();
     image.SaveImageToFile(filename);
 }
 
 void SurfaceMeasurer::process()
 {
+    ASSERT_NDBG(m_inputDepthMap);
+    m_rawDepthMap = m_inputDepthMap;
+
     smoothInput();
-    computeVertexAndNormalMap();
+    for (size_t l = 1; l < m_levels.size(); ++l)
+    {
+        downsample(m_levels[l - 1], m_levels[l]);
+    }
+    for (size_t l = 0; l < m_levels.size(); ++l)
+    {
+        computeVertexAndNormalMap(m_levels[l], m_surfaceMaps[l]);
+    }
 }
 
-PointCloud SurfaceMeasurer::getPointCloud()
+void SurfaceMeasurer::downsample(const Level& fine, Level& coarse) const
 {
-    return m_pointCloud;
+    ThreadPool::global().parallelFor(coarse.height, [&](size_t y)
+    {
+        const float* row0 = &fine.depth[2*y*fine.width];
+        const float* row1 = row0 + fine.width;
+        for (size_t x = 0; x < coarse.width; ++x)
+        {
+            // average of the block pixels close to its first valid pixel
+            const float block[4] = { row0[2*x], row0[2*x + 1], row1[2*x], row1[2*x + 1] };
+            float reference = MINF;
+            float sum = 0;
+            int count = 0;
+            for (const float depth : block)
+            {
+                if (count == 0 && std::isfinite(depth))
+                {
+                    reference = depth;
+                }
+                if (std::abs(depth - reference) <= m_maxDepthDifference)
+                {
+                    sum += depth;
+                    ++count;
+                }
+            }
+            coarse.depth[y*coarse.width + x] = count > 0 ? sum / count : MINF;
+        }
+    });
 }
 
-void SurfaceMeasurer::computeVertexAndNormalMap()
+void SurfaceMeasurer::computeVertexAndNormalMap(const Level& level, SurfaceMap& surfaceMap) const
 {
-    //m_pointCloud.points.reserve(m_DepthImageHeight*m_DepthImageWidth);
-    //m_pointCloud.pointsValid.reserve(m_DepthImageHeight*m_DepthImageWidth);
+    const float fovX = level.intrinsics(0, 0);
+    const float fovY = level.intrinsics(1, 1);
+    const float cX = level.intrinsics(0, 2);
+    const float cY = level.intrinsics(1, 2);
+    const int width = level.width;
+    const int height = level.height;
 
-    //m_pointCloud.normals = std::vector<Vector3f>(m_DepthImageHeight*m_DepthImageWidth);
-    //m_pointCloud.normalsValid = std::vector<bool>(m_DepthImageHeight*m_DepthImageWidth);
+    ThreadPool::global().parallelFor(height, [&](int y)
+    {
+        const size_t offset = size_t(y) * width;
+        const float* row = &level.depth[offset];
+        // the border rows and columns get no normal, the clamped neighbors keep the accesses in the image
+        const bool innerRow = y > 0 && y < height - 1;
+        const float* up = innerRow ? row - width : row;
+        const float* down = innerRow ? row + width : row;
 
-    //#pragma omp parallel for
+        const float v = (y - cY) / fovY;
+        const float vUp = (y - 1 - cY) / fovY;
+        const float vDown = (y + 1 - cY) / fovY;
 
-    float fovX = m_DepthIntrinsics(0, 0);
-    float fovY = m_DepthIntrinsics(1, 1);
-    float cX = m_DepthIntrinsics(0, 2);
-    float cY = m_DepthIntrinsics(1, 2);
+        float* pointX = &surfaceMap.pointX[offset];
+        float* pointY = &surfaceMap.pointY[offset];
+        float* pointZ = &surfaceMap.pointZ[offset];
+        float* normalX = &surfaceMap.normalX[offset];
+        float* normalY = &surfaceMap.normalY[offset];
+        float* normalZ = &surfaceMap.normalZ[offset];
+        uint8_t* mask = &surfaceMap.mask[offset];
 
-    #pragma omp parallel for collapse(2)
-    for(uint y = 0; y < m_DepthImageHeight; ++y)
-    {
-        for(uint x = 0; x < m_DepthImageWidth; ++x)
+        #pragma omp simd
+        for (int x = 0; x < width; ++x)
         {
-            uint idx = y*m_DepthImageWidth + x;
-            const float depth = m_rawDepthMap[idx];
-            if (depth == MINF || depth == NAN)
-            {
-                m_pointCloud.points[idx] = Vector3f(MINF, MINF, MINF);
-                m_pointCloud.pointsValid[idx] = false;
-            }
-            else
-            {
-                // backproject to camera space
-                m_pointCloud.points[idx] = Vector3f((x - cX) / fovX * depth, (y - cY) / fovY * depth, depth);
-                m_pointCloud.pointsValid[idx] = true;
-            }
+            const float depth = row[x];
+            const float u = (x - cX) / fovX;
+            // MINF and NaN
+            const bool pointValid = std::isfinite(depth);
 
-        }
-    }
+            const bool inner = innerRow && x > 0 && x < width - 1;
+            const int left = inner ? x - 1 : x;
+            const int right = inner ? x + 1 : x;
+            const float depthLeft = row[left];
+            const float depthRight = row[right];
+            const float depthUp = up[x];
+            const float depthDown = down[x];
 
-    const float maxDistHalve = 0.05f;
-    #pragma omp parallel for collapse(2)
-    for(uint y = 1; y < m_DepthImageHeight-1; ++y)
-    {
-        for(uint x = 1; x < m_DepthImageWidth-1; ++x)
-        {
-            uint idx = y*m_DepthImageWidth + x;
-            const float du = 0.5f * (m_rawDepthMap[idx + 1] - m_rawDepthMap[idx - 1]);
-            const float dv = 0.5f * (m_rawDepthMap[idx + m_DepthImageWidth] - m_rawDepthMap[idx - m_DepthImageWidth]);
-            if (!std::isfinite(du) || !std::isfinite(dv) || std::abs(du) > maxDistHalve || std::abs(dv) > maxDistHalve)
-            {
-                m_pointCloud.normals[idx] = Vector3f(MINF, MINF, MINF);
-                m_pointCloud.normalsValid[idx] = false;
-            }
-            else
-            {
-                m_pointCloud.normals[idx] = Vector3f(du, dv, -1);
-                m_pointCloud.normals[idx].normalize();
-                m_pointCloud.normalsValid[idx] = true;
-            }
+            // tangents along x and y: differences of the backprojected neighbors
+            const float ax = (x + 1 - cX) / fovX * depthRight - (x - 1 - cX) / fovX * depthLeft;
+            const float ay = v * (depthRight - depthLeft);
+            const float az = depthRight - depthLeft;
+            const float bx = u * (depthDown - depthUp);
+            const float by = vDown * depthDown - vUp * depthUp;
+            const float bz = depthDown - depthUp;
+
+            // b x a points towards the camera
+            const float nx = by * az - bz * ay;
+            const float ny = bz * ax - bx * az;
+            const float nz = bx * ay - by * ax;
+            const float length = std::sqrt(nx * nx + ny * ny + nz * nz);
+
+            // all neighbors are finite if the differences are
+            const bool normalValid = inner && pointValid && length > 0 &&
+                    std::abs(az) <= m_maxDepthDifference && std::abs(bz) <= m_maxDepthDifference;
+
+            pointX[x] = pointValid ? u * depth : MINF;
+            pointY[x] = pointValid ? v * depth : MINF;
+            pointZ[x] = pointValid ? depth : MINF;
+            normalX[x] = normalValid ? nx / length : MINF;
+            normalY[x] = normalValid ? ny / length : MINF;
+            normalZ[x] = normalValid ? nz / length : MINF;
+            mask[x] = (pointValid ? SurfaceMap::POINT_VALID : 0) | (normalValid ? SurfaceMap::NORMAL_VALID : 0);
         }
-    }
-    // edge regions
-    for (uint x = 0; x < m_DepthImageWidth; ++x) {
-        m_pointCloud.normals[x] = Vector3f(MINF, MINF, MINF);
-        m_pointCloud.normals[x + (m_DepthImageHeight - 1) * m_DepthImageWidth] = Vector3f(MINF, MINF, MINF);
-    }
-    for (uint y = 0; y < m_DepthImageHeight; ++y) {
-        m_pointCloud.normals[y * m_DepthImageWidth] = Vector3f(MINF, MINF, MINF);
-        m_pointCloud.normals[(m_DepthImageWidth - 1) + y * m_DepthImageWidth] = Vector3f(MINF, MINF, MINF);
-    }
+    });
 }
-
@@ -1,40 +1,102 @@
 #include <iterator>
+#include <vector>
 
 #include "Eigen.h"
 #include "DataTypes.h"
 #include "StopWatch.h"
 #include "FreeImageHelper.h"
 #include "BilateralFilter.h"
+#include "ThreadPool.h"
 
 //#include <opencv2/core.hpp>
 //#include <opencv2/imgproc.hpp>
 
 // takes the raw depth data and backprojects it into 3D camera space
+// all buffers are allocated once, the input is not modified.
+// besides the full resolution a pyramid of coarser levels is computed: level l+1 has half the width and height
+// of level l, its depth is the average of 2x2 blocks without averaging over depth discontinuities
 class SurfaceMeasurer
 {
 public:
-    SurfaceMeasurer(Eigen::Matrix3f DepthIntrinsics, uint DepthImageHeight, uint DepthImageWidth);
+    SurfaceMeasurer(Eigen::Matrix3f DepthIntrinsics, uint DepthImageHeight, uint DepthImageWidth, uint nLevels = 3);
 
-    // set pointer of m_rawDepthMap. SurfaceMeasurer does not take care of memory management for depthMap
-    void registerInput(float* depthMap);
+    // set pointer to the input depth map. SurfaceMeasurer does not take care of memory management for depthMap,
+    // it is read by the next process() and has to stay valid as long as getRawDepth() is used
+    void registerInput(const float* depthMap);
 
     void saveDepthMap(std::string filename);
 
     // main method: process current depth map
     void process();
 
-    PointCloud getPointCloud();
+    // organized points and normals of pyramid level, in camera space. valid until the next process()
+    const SurfaceMap& getSurfaceMap(size_t level = 0) const
+    {
+        return m_surfaceMaps[level];
+    }
+    // all pyramid levels, level 0 has the full resolution
+    const std::vector<SurfaceMap>& getSurfaceMaps() const
+    {
+        return m_surfaceMaps;
+    }
+
+    size_t getLevels() const
+    {
+        return m_levels.size();
+    }
+    size_t getHeight(size_t level = 0) const
+    {
+        return m_levels[level].height;
+    }
+    size_t getWidth(size_t level = 0) const
+    {
+        return m_levels[level].width;
+    }
+    const Matrix3f& getIntrinsics(size_t level = 0) const
+    {
+        return m_levels[level].intrinsics;
+    }
+
+    // the input of the last process(), not copied
+    const float* getRawDepth() const
+    {
+        return m_rawDepthMap;
+    }
+    // smoothed input of the last process() (level 0) and its downsampled levels, the point clouds are computed from them
+    const float* getSmoothedDepth(size_t level = 0) const
+    {
+        return m_levels[level].depth.data();
+    }
 
 private:
+    struct Level
+    {
+        size_t height;
+        size_t width;
+        Matrix3f intrinsics;
+        std::vector<float> depth;
+    };
+
     void smoothInput();
-    // backproject into camera space
-    void computeVertexAndNormalMap();
+    // block average of fine into coarse
+    void downsample(const Level& fine, Level& coarse) const;
+    // backproject into camera space, normals from the neighboring points. one pass writing all channels of surfaceMap
+    void computeVertexAndNormalMap(const Level& level, SurfaceMap& surfaceMap) const;
 
     // paramters needed for backprojection
     Matrix3f m_DepthIntrinsics;
     size_t m_DepthImageHeight;
     size_t m_DepthImageWidth;
-    float* m_rawDepthMap;
+    const float* m_inputDepthMap = nullptr;
+    // input of the last process()
+    const float* m_rawDepthMap = nullptr;
+    BilateralFilter<5,5> m_filter;
+
+    // depth differences above which pixels are not smoothed or averaged together and lie on different
+    // surfaces for the normals
+    const float m_maxDepthDifference = 0.09f;
 
-    PointCloud m_pointCloud;
+    // level 0 has the full resolution
+    std::vector<Level> m_levels;
+    std::vector<SurfaceMap> m_surfaceMaps;
 };
@@ -4,10 +4,16 @@ SurfacePredictor::SurfacePredictor(std::shared_ptr<Tsdf> tsdf, Matrix3f cameraIn
     : m_tsdf(tsdf),
       m_cameraIntrinsics(cameraIntrinsics)
 {
+    // offsets of the 8 corners of a cell, corner c is at (c & 1, (c >> 1) & 1, c >> 2)
+    const int size = m_tsdf->getSize();
+    m_cornerOffsets = {0, 1, size, size + 1, size*size, size*size + 1, size*size + size, size*size + size + 1};
 }
 
-PointCloud SurfacePredictor::predict(const uint depthImageHeight, const uint depthImageWidth, const Matrix4f pose) const
+void SurfacePredictor::predict(SurfaceMap& surfaceMap, const Matrix4f pose) const
 {
+   const uint depthImageHeight = surfaceMap.height();
+   const uint depthImageWidth = surfaceMap.width();
+
    float fovX = m_cameraIntrinsics(0, 0);
    float fovY = m_cameraIntrinsics(1, 1);
    float cX = m_cameraIntrinsics(0, 2);
@@ -16,15 +22,10 @@ PointCloud SurfacePredictor::predict(const uint depthImageHeight, const uint dep
    Matrix3f rotMatrix = pose.block<3,3>(0,0);
    Vector3f tranVector = pose.block<3,1>(0,3);
 
-   PointCloud pointCloud;
-   pointCloud.pointsValid.resize(depthImageHeight*depthImageWidth);
-   pointCloud.points.resize(depthImageHeight*depthImageWidth);
-   pointCloud.normalsValid.resize(depthImageHeight*depthImageWidth);
-   pointCloud.normals.resize(depthImageHeight*depthImageWidth);
+   // bounds of the volume, shared by all rays
+   const VolumeBounds bounds = volume_bounds();
 
-   #pragma omp parallel for
-//collapse(2) seems to make it slower
-   for(uint y_pixel=0; y_pixel < depthImageHeight; ++y_pixel)
+   ThreadPool::global().parallelFor(depthImageHeight, [&](uint y_pixel)
    {
        for(uint x_pixel=0; x_pixel < depthImageWidth; ++x_pixel)
        {
@@ -37,90 +38,71 @@ PointCloud SurfacePredictor::predict(const uint depthImageHeight, const uint dep
            // position of the camera
            Vector3f rayOriginWorld = tranVector;
 
-           float min_t = compute_min_t(rayOriginWorld, rayDirWorld);
-           float max_t = compute_max_t(rayOriginWorld, rayDirWorld);
-
-           float t_step_size = 0.01; // function of truncation distance
-
-           // loop
-           float prev_sdf;
-
-           // silence maybe-uninitialized warning
-           float sdf = std::numeric_limits<float>::infinity();
-
-           bool is_first_sdf = true;
-           bool found_sign_change = false;
-
-           for(float t=min_t; t<max_t; t+= t_step_size)
-           {
-               Vector3f currPoint = rayOriginWorld + t * rayDirWorld;
-
-               if(is_first_sdf)
-               {
-                   sdf = trilinear_interpolate(currPoint);
-                   is_first_sdf = false;
-                   continue;
-               }
-
-               prev_sdf = sdf;
-
-               // prevents trilinear_interpolate fail for t=t_max
-               if(!m_tsdf->isValid(currPoint))
-               {
-                   break;
-               }
-               sdf = trilinear_interpolate(currPoint);
-
-               if ((prev_sdf > 0 && sdf < 0)  || (prev_sdf == 0 && sdf < 0) || (prev_sdf > 0 && sdf == 0))
-               {
-                   // found a surface
-                   float t_star = t - t_step_size - (t_step_size * prev_sdf) / (sdf - prev_sdf);
-                   Vector3f surfaceVertex = rayOriginWorld + t_star * rayDirWorld;
-
-                   pointCloud.points[idx] = surfaceVertex;
-                   pointCloud.pointsValid[idx] = true;
-                   Vector3f normal;
-                   if(compute_normal(surfaceVertex, normal))
-                   {
-                       pointCloud.normals[idx] = Vector3f(MINF, MINF, MINF);
-                       pointCloud.normalsValid[idx] = false;
-                   }
-                   else
-                   {
-                       pointCloud.normals[idx] = normal;
-                       pointCloud.normalsValid[idx] = true;
-
-                   }
-                   found_sign_change = true;
-                   break;
-
-               }
-               else if ((prev_sdf < 0 && sdf > 0 ) || (prev_sdf == 0 && sdf > 0) || (prev_sdf < 0 && sdf == 0))
-               {
-                   // back of surface
-                   pointCloud.points[idx] = Vector3f(MINF, MINF, MINF);
-                   pointCloud.pointsValid[idx] = false;
-                   pointCloud.normals[idx] = Vector3f(MINF, MINF, MINF);
-                   pointCloud.normalsValid[idx] = false;
-                   found_sign_change = true;
-                   break;
-               }
-               else
-               {
-                   // continue iteration
-               }
-           }
-           if(!found_sign_change)
-           {
-               pointCloud.points[idx] = Vector3f(MINF, MINF, MINF);
-               pointCloud.pointsValid[idx] = false;
-               pointCloud.normals[idx] = Vector3f(MINF, MINF, MINF);
-               pointCloud.normalsValid[idx] = false;
-           }
+           predict_pixel(rayOriginWorld, rayDirWorld, bounds, surfaceMap, idx);
        }
-   }
+   });
+}
+
+void SurfacePredictor::predict(SurfaceMap& surfaceMap, const std::vector<uint>& pixels, const uint depthImageWidth, const Matrix4f pose) const
+{
+   ASSERT_NDBG(surfaceMap.size() == pixels.size());
+
+   float fovX = m_cameraIntrinsics(0, 0);
+   float fovY = m_cameraIntrinsics(1, 1);
+   float cX = m_cameraIntrinsics(0, 2);
+   float cY = m_cameraIntrinsics(1, 2);
+
+   Matrix3f rotMatrix = pose.block<3,3>(0,0);
+   Vector3f tranVector = pose.block<3,1>(0,3);
+
+   const VolumeBounds bounds = volume_bounds();
+
+   ThreadPool::global().parallelFor(pixels.size(), [&](size_t i)
+   {
+       const uint x_pixel = pixels[i] % depthImageWidth;
+       const uint y_pixel = pixels[i] / depthImageWidth;
 
-   return pointCloud;
+       Vector3f rayDirCamera = Vector3f((x_pixel - cX) / fovX, (y_pixel - cY) / fovY, 1);
+       Vector3f rayDirWorld = (rotMatrix*rayDirCamera).normalized();
+
+       predict_pixel(tranVector, rayDirWorld, bounds, surfaceMap, i);
+   });
+}
+
+std::vector<uint> SurfacePredictor::subsampledPixels(const uint depthImageHeight, const uint depthImageWidth, const uint stride)
+{
+    std::vector<uint> pixels;
+    pixels.reserve(((depthImageHeight + stride - 1) / stride) * ((depthImageWidth + stride - 1) / stride));
+    for(uint y_pixel=0; y_pixel < depthImageHeight; y_pixel += stride)
+    {
+        for(uint x_pixel=0; x_pixel < depthImageWidth; x_pixel += stride)
+        {
+            pixels.push_back(y_pixel*depthImageWidth + x_pixel);
+        }
+    }
+    return pixels;
+}
+
+void SurfacePredictor::predict_pixel(const Vector3f& rayOrigin, const Vector3f& rayDir, const VolumeBounds& bounds, SurfaceMap& surfaceMap, const size_t idx) const
+{
+    Vector3f surfaceVertex;
+    if(cast_ray(rayOrigin, rayDir, bounds, surfaceVertex))
+    {
+        // no surface or back of surface
+        surfaceMap.setInvalid(idx);
+        return;
+    }
+
+    surfaceMap.setPoint(idx, surfaceVertex);
+    Vector3f normal;
+    if(compute_normal(surfaceVertex, normal))
+    {
+        surfaceMap.setNormalInvalid(idx);
+    }
+    else
+    {
+        surfaceMap.setNormal(idx, normal);
+    }
 }
 
 void SurfacePredictor::predictColor(uint8_t* colorMap, const uint depthImageHeight, const uint depthImageWidth, const Matrix4f pose) const
@@ -133,6 +115,8 @@ void SurfacePredictor::predictColor(uint8_t* colorMap, const uint depthImageHeig
     Matrix3f rotMatrix = pose.block<3,3>(0,0);
     Vector3f tranVector = pose.block<3,1>(0,3);
 
+    const VolumeBounds bounds = volume_bounds();
+
     for(uint y_pixel=0; y_pixel < depthImageHeight; ++y_pixel)
     {
         for(uint x_pixel=0; x_pixel < depthImageWidth; ++x_pixel)
@@ -146,82 +130,274 @@ void SurfacePredictor::predictColor(uint8_t* colorMap, const uint depthImageHeig
             // position of the camera
             Vector3f rayOriginWorld = tranVector;
 
-            float min_t = compute_min_t(rayOriginWorld, rayDirWorld);
-            float max_t = compute_max_t(rayOriginWorld, rayDirWorld);
+            Vector3f surfaceVertex;
+            // trilinear interpolate the color at surfaceVertex
+            if(cast_ray(rayOriginWorld, rayDirWorld, bounds, surfaceVertex) ||
+               trilinear_interpolate_color(surfaceVertex, colorMap+(idx*3)))
+            {
+                // no surface, back of surface or invalid interpolation
+                colorMap[idx*3] = 255;
+                colorMap[idx*3+1] = 255;
+                colorMap[idx*3+2] = 255;
+            }
+        }
+    }
+}
+
+void SurfacePredictor::render(const RenderView& view, RenderedView& rendered) const
+{
+    render(view, volume_bounds(), rendered);
+}
 
-            float t_step_size = 0.01; // function of truncation distance
+void SurfacePredictor::render(const std::vector<RenderView>& views, const std::function<void(size_t, RenderedView&)>& onRendered) const
+{
+    // shared by all views
+    const VolumeBounds bounds = volume_bounds();
 
-            // loop
-            float prev_sdf;
+    // views and their rows share the pool, a view is passed on as soon as its rows are done
+    ThreadPool::global().parallelFor(views.size(), [&](size_t i)
+    {
+        RenderedView rendered;
+        render(views[i], bounds, rendered);
+        onRendered(i, rendered);
+    });
+}
+
+void SurfacePredictor::render(const RenderView& view, const VolumeBounds& bounds, RenderedView& rendered) const
+{
+    const uint size = view.height*view.width;
+    rendered.height = view.height;
+    rendered.width = view.width;
+    rendered.color.resize(size*3);
+    rendered.depth.resize(size);
+    rendered.normals.resize(size*3);
+
+    float fovX = view.intrinsics(0, 0);
+    float fovY = view.intrinsics(1, 1);
+    float cX = view.intrinsics(0, 2);
+    float cY = view.intrinsics(1, 2);
+
+    Matrix3f rotMatrix = view.pose.block<3,3>(0,0);
+    Vector3f tranVector = view.pose.block<3,1>(0,3);
+
+    ThreadPool::global().parallelFor(view.height, [&](uint y_pixel)
+    {
+        for(uint x_pixel=0; x_pixel < view.width; ++x_pixel)
+        {
+            uint idx = y_pixel*view.width + x_pixel;
 
-            // silence maybe-uninitialized warning
-            float sdf = std::numeric_limits<float>::infinity();
+            Vector3f rayDirCamera = Vector3f((x_pixel - cX) / fovX, (y_pixel - cY) / fovY, 1);
+            Vector3f rayDirWorld = (rotMatrix*rayDirCamera).normalized();
 
-            bool is_first_sdf = true;
-            bool found_sign_change = false;
+            uint8_t* color = rendered.color.data() + idx*3;
+            float* normal = rendered.normals.data() + idx*3;
 
-            for(float t=min_t; t<max_t; t+= t_step_size)
+            Vector3f surfaceVertex;
+            if(cast_ray(tranVector, rayDirWorld, bounds, surfaceVertex))
             {
-                Vector3f currPoint = rayOriginWorld + t * rayDirWorld;
-
-                if(is_first_sdf)
-                {
-                    sdf = trilinear_interpolate(currPoint);
-                    is_first_sdf = false;
-                    continue;
-                }
-
-                prev_sdf = sdf;
-
-                // prevents trilinear_interpolate fail for t=t_max
-                if(!m_tsdf->isValid(currPoint))
-                {
-                    break;
-                }
-                sdf = trilinear_interpolate(currPoint);
-
-                if ((prev_sdf > 0 && sdf < 0)  || (prev_sdf == 0 && sdf < 0) || (prev_sdf > 0 && sdf == 0))
-                {
-                    // found a surface
-                    float t_star = t - t_step_size - (t_step_size * prev_sdf) / (sdf - prev_sdf);
-                    Vector3f surfaceVertex = rayOriginWorld + t_star * rayDirWorld;
-
-                    // trilinear interpolate the color at surfaceVertex
-                    if(trilinear_interpolate_color(surfaceVertex, colorMap+(idx*3)))
-                    {
-                        // invalid interpolation
-                        colorMap[idx*3] = 255;
-                        colorMap[idx*3+1] = 255;
-                        colorMap[idx*3+2] = 255;
-                        found_sign_change = true;
-                        break;
-                    }
-                    found_sign_change = true;
-                    break;
-
-                }
-                else if ((prev_sdf < 0 && sdf > 0 ) || (prev_sdf == 0 && sdf > 0) || (prev_sdf < 0 && sdf == 0))
-                {
-                    // back of surface
-                    colorMap[idx*3] = 255;
-                    colorMap[idx*3+1] = 255;
-                    colorMap[idx*3+2] = 255;
-                    found_sign_change = true;
-                    break;
-                }
-                else
-                {
-                    // continue iteration
-                }
+                color[0] = color[1] = color[2] = 255;
+                rendered.depth[idx] = MINF;
+                normal[0] = normal[1] = normal[2] = MINF;
+                continue;
             }
-            if(!found_sign_change)
+
+            if(trilinear_interpolate_color(surfaceVertex, color))
             {
-                colorMap[idx*3] = 255;
-                colorMap[idx*3+1] = 255;
-                colorMap[idx*3+2] = 255;
+                color[0] = color[1] = color[2] = 255;
             }
+
+            // depth along the optical axis of the view
+            rendered.depth[idx] = (rotMatrix.transpose()*(surfaceVertex - tranVector)).z();
+
+            Vector3f n;
+            if(compute_normal(surfaceVertex, n))
+            {
+                normal[0] = normal[1] = normal[2] = MINF;
+            }
+            else
+            {
+                normal[0] = n.x();
+                normal[1] = n.y();
+                normal[2] = n.z();
+            }
+        }
+    });
+}
+
+bool SurfacePredictor::cast_ray(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds, Vector3f& surfaceVertex) const
+{
+    const float min_t = compute_min_t(origin, direction, bounds);
+    const float max_t = compute_max_t(origin, direction, bounds);
+    if(!(min_t < max_t))
+    {
+        // ray misses the volume
+        return true;
+    }
+
+    // 3D DDA, see also:
+    // J. Amanatides, A. Woo: "A Fast Voxel Traversal Algorithm for Ray Tracing" 1987
+    // the ray is traversed in voxel coordinates cell by cell. the world point origin + t*direction
+    // is at rayOrigin + t*rayDir in voxel coordinates, so t is the same in both spaces.
+    const float voxelSize = m_tsdf->getVoxelSize();
+    const Vector3f rayOrigin = (origin - m_tsdf->getOrigin()) / voxelSize;
+    const Vector3f rayDir = direction / voxelSize;
+
+    const int size = m_tsdf->getSize();
+    // cells are indexed by their lower corner, so the last cell is at size-2
+    const int lastCell = size - 2;
+    const int strides[3] = {1, size, size*size};
+
+    int cell[3];
+    int step[3];
+    float tNext[3];
+    float tDelta[3];
+    const Vector3f entry = rayOrigin + min_t * rayDir;
+    for(int dim=0; dim<3; ++dim)
+    {
+        cell[dim] = std::min(std::max(static_cast<int>(std::floor(entry[dim])), 0), lastCell);
+        if(rayDir[dim] > 0)
+        {
+            step[dim] = 1;
+            tNext[dim] = (cell[dim] + 1 - rayOrigin[dim]) / rayDir[dim];
+            tDelta[dim] = 1 / rayDir[dim];
+        }
+        else if(rayDir[dim] < 0)
+        {
+            step[dim] = -1;
+            tNext[dim] = (cell[dim] - rayOrigin[dim]) / rayDir[dim];
+            tDelta[dim] = -1 / rayDir[dim];
         }
+        else
+        {
+            step[dim] = 0;
+            tNext[dim] = std::numeric_limits<float>::infinity();
+            tDelta[dim] = std::numeric_limits<float>::infinity();
+        }
+    }
+
+    int baseIdx = cell[0] + cell[1]*strides[1] + cell[2]*strides[2];
+    // values and observation of the corners of the current cell, carried over to the next cell on the shared face
+    float corners[8];
+    bool cornerValid[8];
+    bool cellValid = true;
+    for(int c=0; c<8; ++c)
+    {
+        const int idx = baseIdx + m_cornerOffsets[c];
+        corners[c] = (*m_tsdf)(idx);
+        cornerValid[c] = m_tsdf->weight(idx) != 0;
+        cellValid &= cornerValid[c];
     }
+
+    // trilinear interpolation within the current cell
+    auto interpolate = [&](const float t) -> float
+    {
+        const float u_ = std::min(std::max(rayOrigin.x() + t*rayDir.x() - cell[0], 0.f), 1.f);
+        const float v_ = std::min(std::max(rayOrigin.y() + t*rayDir.y() - cell[1], 0.f), 1.f);
+        const float w_ = std::min(std::max(rayOrigin.z() + t*rayDir.z() - cell[2], 0.f), 1.f);
+        const float u[] = {1 - u_, u_};
+        const float v[] = {1 - v_, v_};
+        const float w[] = {1 - w_, w_};
+        float p = 0;
+        for(int c=0; c<8; ++c)
+        {
+            p += u[c & 1] * v[(c >> 1) & 1] * w[c >> 2] * corners[c];
+        }
+        return p;
+    };
+
+    // no distance information available
+    const float noInfo = std::numeric_limits<float>::max();
+
+    float t = min_t;
+    float sdf = cellValid ? interpolate(t) : noInfo;
+
+    while(true)
+    {
+        int dim = (tNext[0] < tNext[1]) ? 0 : 1;
+        dim = (tNext[2] < tNext[dim]) ? 2 : dim;
+        const float t_exit = std::min(tNext[dim], max_t);
+
+        const float prev_sdf = sdf;
+        sdf = cellValid ? interpolate(t_exit) : noInfo;
+
+        if(cellValid)
+        {
+            if ((prev_sdf > 0 && sdf < 0)  || (prev_sdf == 0 && sdf < 0) || (prev_sdf > 0 && sdf == 0))
+            {
+                // found a surface
+                float t_star = t + (t_exit - t) * prev_sdf / (prev_sdf - sdf);
+                surfaceVertex = origin + t_star * direction;
+                return false;
+            }
+            else if ((prev_sdf < 0 && sdf > 0 ) || (prev_sdf == 0 && sdf > 0) || (prev_sdf < 0 && sdf == 0))
+            {
+                // back of surface
+                return true;
+            }
+        }
+
+        if(t_exit >= max_t)
+        {
+            return true;
+        }
+
+        // step into the next cell, bounds checks are integer comparisons
+        cell[dim] += step[dim];
+        if(cell[dim] < 0 || cell[dim] > lastCell)
+        {
+            return true;
+        }
+        baseIdx += step[dim]*strides[dim];
+        t = t_exit;
+        tNext[dim] += tDelta[dim];
+
+        // the 4 corners on the shared face are already loaded, only the 4 new ones are read
+        const int bit = 1 << dim;
+        for(int c=0; c<8; ++c)
+        {
+            const bool onSharedFace = (step[dim] > 0) ? !(c & bit) : (c & bit);
+            if(onSharedFace)
+            {
+                corners[c] = corners[c ^ bit];
+                cornerValid[c] = cornerValid[c ^ bit];
+            }
+        }
+        bool nextValid = true;
+        for(int c=0; c<8; ++c)
+        {
+            const bool onSharedFace = (step[dim] > 0) ? !(c & bit) : (c & bit);
+            if(!onSharedFace)
+            {
+                const int idx = baseIdx + m_cornerOffsets[c];
+                corners[c] = (*m_tsdf)(idx);
+                cornerValid[c] = m_tsdf->weight(idx) != 0;
+            }
+            nextValid &= cornerValid[c];
+        }
+
+        if(nextValid)
+        {
+            // the interpolation is continuous across cells: reuse the exit value if possible
+            sdf = cellValid ? sdf : interpolate(t);
+        }
+        else if(cellValid && sdf < 0)
+        {
+            // leaving the observed surface from behind
+            return true;
+        }
+        cellValid = nextValid;
+    }
+}
+
+SurfacePredictor::VolumeBounds SurfacePredictor::volume_bounds() const
+{
+    VolumeBounds bounds;
+    // get point at highest index: size^3 - 1
+    bounds.max = m_tsdf->getPoint(pow(m_tsdf->getSize(), 3) - 1).head(3);
+
+    // get point at lowest index: 0
+    bounds.min = m_tsdf->getPoint(0).head(3);
+    return bounds;
 }
 
 
@@ -234,69 +410,104 @@ float SurfacePredictor::trilinear_interpolate(const Vector3f& point) const
 
 bool SurfacePredictor::trilinear_interpolate(const Vector3f& point, float& value) const
 {
-    Vector3f relPoint = point - m_tsdf->getOrigin();
-
-    float x = relPoint.x() / m_tsdf->getVoxelSize();
-    float y = relPoint.y() / m_tsdf->getVoxelSize();
-    float z = relPoint.z() / m_tsdf->getVoxelSize();
-
-    // for numeric stability: set negative values within 0.5 index to small positive number
-    x = (-0.5 < x && x < 0) ? std::numeric_limits<float>::epsilon() : x;
-    y = (-0.5 < y && y < 0) ? std::numeric_limits<float>::epsilon() : y;
-    z = (-0.5 < z && z < 0) ? std::numeric_limits<float>::epsilon() : z;
-
-    // to deal with boundary values, where x == m_tsdf->getSize()-1
-    x = (x >= m_tsdf->getSize() - 1) ? x - x*std::numeric_limits<float>::epsilon() : x;
-    y = (y >= m_tsdf->getSize() - 1) ? y - y*std::numeric_limits<float>::epsilon() : y;
-    z = (y >= m_tsdf->getSize() - 1) ? z - z*std::numeric_limits<float>::epsilon() : z;
-
-    // valid interpolation only possible with:
-    // x >= 0, y>=0, z>=0 with equality
-    // x < max_x, y < max_y ... no equality!
-    ASSERT_NDBG(!((x < 0) || (y < 0) || (z < 0)));
-    ASSERT_NDBG(!((x >= m_tsdf->getSize() - 1) || (y >= m_tsdf->getSize() - 1) || (z >= m_tsdf->getSize() - 1)));
+    int baseIdx;
+    Vector3f uvw;
+    float corners[8];
+    locate_cell(point, baseIdx, uvw);
+    if(load_corners(baseIdx, corners))
+    {
+        // no distance information available
+        value = std::numeric_limits<float>::max();
+        return true;
+    }
 
     // notation follows
     // S. Parker: "Interactive Ray Tracing for Isosurface Rendering" 1999
+    const float u[] = {1 - uvw.x(), uvw.x()};
+    const float v[] = {1 - uvw.y(), uvw.y()};
+    const float w[] = {1 - uvw.z(), uvw.z()};
 
-    int x_0 = std::floor(x);
-    int y_0 = std::floor(y);
-    int z_0 = std::floor(z);
+    float p = 0;
+    for(int c=0; c<8; ++c)
+    {
+        p += u[c & 1] * v[(c >> 1) & 1] * w[c >> 2] * corners[c];
+    }
+
+    value = p;
+    return false;
+}
 
-    float u_ = x - x_0;
-    float v_ = y - y_0;
-    float w_ = z - z_0;
+bool SurfacePredictor::sample(const Vector3f& point, float& value, Vector3f& gradient) const
+{
+    int baseIdx;
+    Vector3f uvw;
+    float corners[8];
+    locate_cell(point, baseIdx, uvw);
+    if(load_corners(baseIdx, corners))
+    {
+        value = std::numeric_limits<float>::max();
+        return true;
+    }
 
-    float u[] = {1 - u_, u_};
-    float v[] = {1 - v_, v_};
-    float w[] = {1 - w_, w_};
+    const float u[] = {1 - uvw.x(), uvw.x()};
+    const float v[] = {1 - uvw.y(), uvw.y()};
+    const float w[] = {1 - uvw.z(), uvw.z()};
+    // derivatives of the interpolation weights
+    const float d[] = {-1, 1};
 
     float p = 0;
-
-    for(int i=0; i<2; ++i)
+    Vector3f grad(0, 0, 0);
+    for(int c=0; c<8; ++c)
     {
-        for(int j=0; j<2; ++j)
-        {
-            for(int k=0; k<2; ++k)
-            {
-                p += u[i] * v[j] * w[k] * (*m_tsdf)(x_0+i, y_0+j, z_0+k);
-
-                // at least one of the used points has weight zero
-                if(!m_tsdf->weight(m_tsdf->ravel_index(x_0+i, y_0+j, z_0+k)))
-                {
-                    // no distance information available
-                    value = std::numeric_limits<float>::max();
-                    return true;
-                }
-            }
-        }
+        const int i = c & 1, j = (c >> 1) & 1, k = c >> 2;
+        p += u[i] * v[j] * w[k] * corners[c];
+        grad.x() += d[i] * v[j] * w[k] * corners[c];
+        grad.y() += u[i] * d[j] * w[k] * corners[c];
+        grad.z() += u[i] * v[j] * d[k] * corners[c];
     }
 
     value = p;
+    // from voxel units to world units
+    gradient = grad / m_tsdf->getVoxelSize();
     return false;
 }
 
 bool SurfacePredictor::trilinear_interpolate_color(const Vector3f &point, uint8_t *rgb) const
+{
+    int baseIdx;
+    Vector3f uvw;
+    float corners[8];
+    locate_cell(point, baseIdx, uvw);
+    // at least one of the used points has weight zero
+    if(load_corners(baseIdx, corners))
+    {
+        return true;
+    }
+
+    const float u[] = {1 - uvw.x(), uvw.x()};
+    const float v[] = {1 - uvw.y(), uvw.y()};
+    const float w[] = {1 - uvw.z(), uvw.z()};
+
+    float r, g, b;
+    r = g = b = 0;
+
+    for(int c=0; c<8; ++c)
+    {
+        const float weight = u[c & 1] * v[(c >> 1) & 1] * w[c >> 2];
+        const int idx = baseIdx + m_cornerOffsets[c];
+        r += weight * m_tsdf->colorR(idx);
+        g += weight * m_tsdf->colorG(idx);
+        b += weight * m_tsdf->colorB(idx);
+    }
+
+    *rgb     = (r <= 255) ? static_cast<uint8_t>(r) : 255;
+    *(rgb+1) = (g <= 255) ? static_cast<uint8_t>(g) : 255;
+    *(rgb+2) = (b <= 255) ? static_cast<uint8_t>(b) : 255;
+
+    return false;
+}
+
+void SurfacePredictor::locate_cell(const Vector3f& point, int& baseIdx, Vector3f& uvw) const
 {
     Vector3f relPoint = point - m_tsdf->getOrigin();
 
@@ -312,7 +523,7 @@ bool SurfacePredictor::trilinear_interpolate_color(const Vector3f &point, uint8_
     // to deal with boundary values, where x == m_tsdf->getSize()-1
     x = (x >= m_tsdf->getSize() - 1) ? x - x*std::numeric_limits<float>::epsilon() : x;
     y = (y >= m_tsdf->getSize() - 1) ? y - y*std::numeric_limits<float>::epsilon() : y;
-    z = (y >= m_tsdf->getSize() - 1) ? z - z*std::numeric_limits<float>::epsilon() : z;
+    z = (z >= m_tsdf->getSize() - 1) ? z - z*std::numeric_limits<float>::epsilon() : z;
 
     // valid interpolation only possible with:
     // x >= 0, y>=0, z>=0 with equality
@@ -320,59 +531,31 @@ bool SurfacePredictor::trilinear_interpolate_color(const Vector3f &point, uint8_
     ASSERT_NDBG(!((x < 0) || (y < 0) || (z < 0)));
     ASSERT_NDBG(!((x >= m_tsdf->getSize() - 1) || (y >= m_tsdf->getSize() - 1) || (z >= m_tsdf->getSize() - 1)));
 
-    // notation follows
-    // S. Parker: "Interactive Ray Tracing for Isosurface Rendering" 1999
-
     int x_0 = std::floor(x);
     int y_0 = std::floor(y);
     int z_0 = std::floor(z);
 
-    float u_ = x - x_0;
-    float v_ = y - y_0;
-    float w_ = z - z_0;
-
-    float u[] = {1 - u_, u_};
-    float v[] = {1 - v_, v_};
-    float w[] = {1 - w_, w_};
-
-    float r, g, b;
-    r = g = b = 0;
+    baseIdx = m_tsdf->ravel_index(x_0, y_0, z_0);
+    uvw = Vector3f(x - x_0, y - y_0, z - z_0);
+}
 
-    for(int i=0; i<2; ++i)
+bool SurfacePredictor::load_corners(const int baseIdx, float* corners) const
+{
+    const Tsdf& tsdf = *m_tsdf;
+    bool hasWeight = true;
+    for(int c=0; c<8; ++c)
     {
-        for(int j=0; j<2; ++j)
-        {
-            for(int k=0; k<2; ++k)
-            {
-                r += u[i] * v[j] * w[k] * m_tsdf->colorR(m_tsdf->ravel_index(x_0+i, y_0+j, z_0+k));
-                g += u[i] * v[j] * w[k] * m_tsdf->colorG(m_tsdf->ravel_index(x_0+i, y_0+j, z_0+k));
-                b += u[i] * v[j] * w[k] * m_tsdf->colorB(m_tsdf->ravel_index(x_0+i, y_0+j, z_0+k));
-
-                // at least one of the used points has weight zero
-                if(!m_tsdf->weight(m_tsdf->ravel_index(x_0+i, y_0+j, z_0+k)))
-                {
-                    return true;
-                }
-            }
-        }
+        corners[c] = tsdf(baseIdx + m_cornerOffsets[c]);
+        hasWeight &= tsdf.weight(baseIdx + m_cornerOffsets[c]) != 0;
     }
-
-    *rgb     = (r <= 255) ? static_cast<uint8_t>(r) : 255;
-    *(rgb+1) = (g <= 255) ? static_cast<uint8_t>(g) : 255;
-    *(rgb+2) = (b <= 255) ? static_cast<uint8_t>(b) : 255;
-
-    return false;
+    // at least one of the used points has weight zero
+    return !hasWeight;
 }
 
-
-
-float SurfacePredictor::compute_min_t(Vector3f origin, Vector3f direction) const
+float SurfacePredictor::compute_min_t(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds) const
 {
-    // get point at highest index: size^3 - 1
-    Vector3f vol_max = m_tsdf->getPoint(pow(m_tsdf->getSize(), 3) - 1).head(3);
-
-    // get point at lowest index: 0
-    Vector3f vol_min = m_tsdf->getPoint(0).head(3);
+    const Vector3f& vol_max = bounds.max;
+    const Vector3f& vol_min = bounds.min;
 
     float min_t_x = ((direction.x() > 0 ? vol_min.x() : vol_max.x()) - origin.x()) / direction.x();
     float min_t_y = ((direction.y() > 0 ? vol_min.y() : vol_max.y()) - origin.y()) / direction.y();
@@ -381,13 +564,10 @@ float SurfacePredictor::compute_min_t(Vector3f origin, Vector3f direction) const
     return std::max<float>(0, std::max<float>(std::max<float>(min_t_x, min_t_y), min_t_z));
 }
 
-float SurfacePredictor::compute_max_t(Vector3f origin, Vector3f direction) const
+float SurfacePredictor::compute_max_t(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds) const
 {
-    // get point at highest index: size^3 - 1
-    Vector3f vol_max = m_tsdf->getPoint(pow(m_tsdf->getSize(), 3) - 1).head(3);
-
-    // get point at lowest index: 0
-    Vector3f vol_min = m_tsdf->getPoint(0).head(3);
+    const Vector3f& vol_max = bounds.max;
+    const Vector3f& vol_min = bounds.min;
 
     float min_t_x = ((direction.x() > 0 ? vol_max.x() : vol_min.x()) - origin.x()) / direction.x();
     float min_t_y = ((direction.y() > 0 ? vol_max.y() : vol_min.y()) - origin.y()) / direction.y();
@@ -398,36 +578,13 @@ float SurfacePredictor::compute_max_t(Vector3f origin, Vector3f direction) const
 
 bool SurfacePredictor::compute_normal(const Vector3f& point, Vector3f& normal) const
 {
-    float dp = m_tsdf->getVoxelSize();
-    for(int dim=0; dim<3; dim++)
+    float value;
+    Vector3f gradient;
+    if(sample(point, value, gradient) || gradient.isZero())
     {
-        Vector3f p1 = point;
-        p1[dim] -= dp;
-        if(!m_tsdf->isValid(p1))
-        {
-            return true;
-        }
-
-        Vector3f p2 = point;
-        p2[dim] += dp;
-        if(!m_tsdf->isValid(p2))
-        {
-            return true;
-        }
-
-        float n1, n2;
-        if(trilinear_interpolate(p2, n2))
-        {
-            return true;
-        }
-        if(trilinear_interpolate(p1, n1))
-        {
-            return true;
-        }
-        normal[dim] = n2 - n1;
+        return true;
     }
-    normal = normal.normalized();
+    normal = gradient.normalized();
 
     return false;
 }
-
@@ -1,7 +1,33 @@
 #include <memory>
+#include <array>
+#include <functional>
 
 #include "Eigen.h"
 #include "DataTypes.h"
+#include "ThreadPool.h"
+
+// a virtual camera for offscreen rendering
+struct RenderView
+{
+    Matrix4f pose = Matrix4f::Identity();
+    Matrix3f intrinsics;
+    uint height;
+    uint width;
+};
+
+// images rendered from a RenderView, stored row major
+struct RenderedView
+{
+    uint height = 0;
+    uint width = 0;
+    // rgb, white where no surface was hit
+    std::vector<uint8_t> color;
+    // z coordinate in the frame of the view, MINF where no surface was hit
+    std::vector<float> depth;
+    // xyz of the normals in world space, MINF where invalid
+    std::vector<float> normals;
+};
+
 // predict an image to a certain pose from the global model
 // this is equivalent to taking a shapshot of the global model with a 'virutal' camera from a certain pose.
 class SurfacePredictor
@@ -9,24 +35,58 @@ class SurfacePredictor
 public:
     SurfacePredictor(std::shared_ptr<Tsdf> tsdf, Matrix3f cameraIntrinsics);
 
-    // predict a PointCloud to a certain pose (depth information only)
-    PointCloud predict(const uint depthImageHeight, const uint depthImageWidth, const Matrix4f pose = Matrix4f::Identity()) const;
+    // predict points and normals to a certain pose (depth information only)
+    // surfaceMap is filled in place, its size determines the size of the predicted image
+    void predict(SurfaceMap& surfaceMap, const Matrix4f pose = Matrix4f::Identity()) const;
+    // sparse prediction: only raycast the given pixels (linear indices into an image of width depthImageWidth)
+    // the result for pixels[i] is written to entry i of surfaceMap, which needs to have pixels.size() entries
+    void predict(SurfaceMap& surfaceMap, const std::vector<uint>& pixels, const uint depthImageWidth, const Matrix4f pose = Matrix4f::Identity()) const;
+    // every stride-th pixel in both directions, e.g. for sparse prediction
+    static std::vector<uint> subsampledPixels(const uint depthImageHeight, const uint depthImageWidth, const uint stride);
     // predict a color image from a certain pose
     // color image gets stored in the memory pointed to by colorMap
     void predictColor(uint8_t* colorMap, const uint depthImageHeight, const uint depthImageWidth, const Matrix4f pose = Matrix4f::Identity()) const;
+    // render color, depth and normal image of a view in one raycast
+    void render(const RenderView& view, RenderedView& rendered) const;
+    // render several views in parallel. onRendered(i, rendered) is called as soon as views[i] is finished,
+    // possibly from different threads at the same time.
+    void render(const std::vector<RenderView>& views, const std::function<void(size_t, RenderedView&)>& onRendered) const;
+    // interpolated tsdf value and its analytic gradient (in world units) from a single fetch of the 8 surrounding
+    // voxels. returns true if no distance information is available
+    bool sample(const Vector3f& point, float& value, Vector3f& gradient) const;
 
 private:
+   // axis aligned bounding box of the volume
+   struct VolumeBounds
+   {
+       Vector3f min;
+       Vector3f max;
+   };
+
+   void render(const RenderView& view, const VolumeBounds& bounds, RenderedView& rendered) const;
+   // raycast one pixel and write point and normal to surfaceMap at idx
+   void predict_pixel(const Vector3f& rayOrigin, const Vector3f& rayDir, const VolumeBounds& bounds, SurfaceMap& surfaceMap, const size_t idx) const;
+   // march along a ray until the first surface is hit
+   // returns true if there is no surface (or the back of a surface) along the ray
+   bool cast_ray(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds, Vector3f& surfaceVertex) const;
+   VolumeBounds volume_bounds() const;
    // interpolate m_tsdf to continous locations
    float trilinear_interpolate(const Vector3f& point) const;
    bool trilinear_interpolate(const Vector3f& point, float& value) const;
    bool trilinear_interpolate_color(const Vector3f& point, uint8_t* rgb) const;
+   // linear index of the lower corner of the cell containing point and the position within this cell
+   void locate_cell(const Vector3f& point, int& baseIdx, Vector3f& uvw) const;
+   // load the tsdf values at the 8 corners of a cell, returns true if one of them has no weight
+   bool load_corners(const int baseIdx, float* corners) const;
    // estimate parameter 't' for raycasting
-   float compute_min_t(Vector3f origin, Vector3f direction) const;
-   float compute_max_t(Vector3f origin, Vector3f direction) const;
+   float compute_min_t(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds) const;
+   float compute_max_t(const Vector3f& origin, const Vector3f& direction, const VolumeBounds& bounds) const;
    // compute the normal on the surface at point using m_tsdf
    bool compute_normal(const Vector3f& point, Vector3f& normal) const;
 
    std::shared_ptr<Tsdf> m_tsdf;
    Matrix3f m_cameraIntrinsics;
+   // linear index offsets of the corners of a cell
+   std::array<int, 8> m_cornerOffsets;
 
 };
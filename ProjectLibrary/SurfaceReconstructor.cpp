@@ -17,8 +17,8 @@ void SurfaceReconstructor::reconstruct(const float* rawDepthMap,
     // for each point in the tsdf:
     // loop over idx
 
-    #pragma omp parallel for
-    for(size_t idx=0; idx < (m_tsdf->getSize()*m_tsdf->getSize()*m_tsdf->getSize()); ++idx)
+    const size_t nVoxels = static_cast<size_t>(m_tsdf->getSize())*m_tsdf->getSize()*m_tsdf->getSize();
+    ThreadPool::global().parallelFor(nVoxels, [&](size_t idx)
     {
 
         Vector4f globalPoint = m_tsdf->getPoint(idx);
@@ -66,5 +66,5 @@ void SurfaceReconstructor::reconstruct(const float* rawDepthMap,
                 }
             }
         }
-    }
+    });
 }
@@ -2,6 +2,7 @@
 
 #include "Eigen.h"
 #include "DataTypes.h"
+#include "ThreadPool.h"
 // integrates a depth frame into the global model
 class SurfaceReconstructor
 {
@@ -1,7 +1,13 @@
 #pragma once
 #include <array>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
 #include <math.h>
 
+#include "ThreadPool.h"
+
 /**
  * Calculates a square gaussian kernel
  * @tparam size The size of size^2 gaussian kernel.
@@ -47,8 +53,33 @@ struct GaussianKernel
     std::array<T, size*size> kernel;
 };
 
+/**
+ * Calculates the 1D gaussian kernel of GaussianKernel<size,sigma>, the square kernel is its outer product
+ * with itself. Filtering with it along x and then along y is the same as filtering with the square kernel.
+ */
+template<int size, int sigma, typename T = float>
+struct SeparableGaussianKernel
+{
+    constexpr SeparableGaussianKernel()
+        : kernel()
+    {
+        const GaussianKernel<size, sigma, T> square;
+        for (int x = 0; x < size; ++x)
+        {
+            for (int y = 0; y < size; ++y)
+            {
+                kernel.at(x) += square.kernel.at(x + size*y);
+            }
+        }
+    }
+    std::array<T, size> kernel;
+};
+
 /**
  * Performs bilateral filtering
+ * Pixels are weighted by their distance (gaussian kernel) and by the difference of their value to the
+ * center value (gaussian range kernel). Neighbors differing by more than 3 sigmaRange (depth discontinuities)
+ * and invalid pixels (MINF) are ignored, invalid pixels stay invalid.
  * @tparam size The size of size^2 gaussian kernel.
  * @tparam sigma Sigma of gaussian. Type is int because of being a template paramter.
  */
@@ -60,17 +91,43 @@ public:
      * @brief BilateralFilter
      * @param imageWidth Width of Image to be processed.
      * @param imageHeight Height of Image to be processed.
+     * @param sigmaRange Sigma of the range kernel in units of the image values.
+     *        0: spatial gaussian only, pixels outside the image count as 0. invalid pixels are skipped,
+     *        the weights of the valid ones are renormalized.
+     *        It is computed separably: size instead of size^2 multiply-adds per pixel.
      */
-    BilateralFilter(size_t imageWidth, size_t imageHeight)
+    BilateralFilter(size_t imageWidth, size_t imageHeight, float sigmaRange = 0)
         : w(imageWidth),
           h(imageHeight),
           it_s(size/2),
-          tempImage(new float[w*h])
-    {}
-
-    ~BilateralFilter()
+          paddedWidth(w + 2*it_s),
+          paddedImage(paddedWidth * (h + 2*it_s)),
+          sigmaRange(sigmaRange)
     {
-        delete[] tempImage;
+        if (sigmaRange <= 0)
+        {
+            // the rows above and below the image stay 0, with full weight
+            paddedWeight.resize(paddedImage.size());
+            horizontalImage.assign(w * (h + 2*it_s), 0.f);
+            horizontalWeight.assign(w * (h + 2*it_s), 1.f);
+        }
+        if (sigmaRange > 0)
+        {
+            // range weights of |difference| in [0, 3 sigmaRange), the last entry cuts off larger differences
+            rangeScale = (rangeLutSize - 1) / (3 * sigmaRange);
+            for (int i = 0; i < rangeLutSize - 1; ++i)
+            {
+                const float difference = i / rangeScale;
+                rangeLut[i] = std::exp(-difference * difference / (2 * sigmaRange * sigmaRange));
+            }
+            rangeLut[rangeLutSize - 1] = 0;
+
+            // the rows are split into fixed blocks, each block has its own row buffers
+            nBlocks = std::max<size_t>(1, std::min(h, blocksPerThread * (ThreadPool::global().size() + 1)));
+            rowSum.resize(nBlocks * w);
+            rowWeightSum.resize(nBlocks * w);
+            rowBins.resize(nBlocks * w);
+        }
     }
 
     /**
@@ -79,43 +136,178 @@ public:
      */
     void apply(float* image)
     {
-        std::copy(image, image+w*h, tempImage);
+        apply(image, image);
+    }
 
-        //#pragma omp parallel for
-        for(size_t x = 0; x < w; ++x)
+    /**
+     * @brief apply Apply filter object to input and write the result to output.
+     * @param input pointer to image
+     * @param output pointer to image of the same size, may be input
+     */
+    void apply(const float* input, float* output)
+    {
+        ThreadPool& pool = ThreadPool::global();
+        if (sigmaRange <= 0)
         {
-            for(size_t y = 0; y < h; ++y)
+            // padded copy and its weights: 1 for valid pixels and the padding, 0 for invalid pixels
+            std::fill(paddedImage.begin(), paddedImage.end(), 0.f);
+            std::fill(paddedWeight.begin(), paddedWeight.end(), 1.f);
+            pool.parallelFor(h, [&](size_t y)
             {
-                image[x + w*y] = evalKernel(tempImage, x, y);
-            }
+                float* row = &paddedImage[(y + it_s)*paddedWidth + it_s];
+                float* weightRow = &paddedWeight[(y + it_s)*paddedWidth + it_s];
+                for (size_t x = 0; x < w; ++x)
+                {
+                    const float value = input[x + w*y];
+                    row[x] = std::isfinite(value) ? value : 0.f;
+                    weightRow[x] = std::isfinite(value) ? 1.f : 0.f;
+                }
+            });
+            filterSeparable(input, output);
+            return;
         }
+
+        // padded copy, the kernel needs no bounds checks
+        std::fill(paddedImage.begin(), paddedImage.end(), invalidValue);
+        pool.parallelFor(h, [&](size_t y)
+        {
+            float* row = &paddedImage[(y + it_s)*paddedWidth + it_s];
+            for (size_t x = 0; x < w; ++x)
+            {
+                const float value = input[x + w*y];
+                row[x] = std::isfinite(value) ? value : invalidValue;
+            }
+        });
+
+        // row by row, each kernel tap is applied to a whole row so the inner loop vectorizes
+        pool.parallelFor(nBlocks, [&](size_t block)
+        {
+            const size_t offset = block * w;
+            for (size_t y = block * h / nBlocks; y < (block + 1) * h / nBlocks; ++y)
+            {
+                filterRow(output, y, &rowSum[offset], &rowWeightSum[offset], &rowBins[offset]);
+            }
+        });
     }
 
 private:
-    float evalKernel(const float* in, size_t x, size_t y) const
+    void filterRow(float* image, size_t y, float* sum, float* weightSum, int* bins) const
     {
-        float res = 0;
+        const float* center = &paddedImage[(y + it_s)*paddedWidth + it_s];
+        std::fill(sum, sum + w, 0.f);
+        std::fill(weightSum, weightSum + w, 0.f);
+        const float* lut = rangeLut.data();
+        const float scale = rangeScale;
+        const float maxBin = rangeLutSize - 1;
 
-        for (int i = -it_s; i <= it_s; ++i)
+        for (int j = -it_s; j <= it_s; ++j)
         {
-            for (int j = -it_s; j <= it_s; ++j)
+            for (int i = -it_s; i <= it_s; ++i)
             {
-                // skip values at the corner (simulates zero-padding)
-                if(int(x)+i < 0 || int(x)+i >= w || int(y)+j < 0 || int(y)+j >= h)
+                const float spatialWeight = kernel.kernel[i+it_s + (j+it_s)*size];
+                const float* neighbor = center + j*int(paddedWidth) + i;
+
+                // bins and lookup in separate loops, both vectorize
+                #pragma omp simd
+                for (size_t x = 0; x < w; ++x)
+                {
+                    // invalid pixels are large but finite, so the difference is never NaN
+                    const float bin = std::abs(neighbor[x] - center[x]) * scale;
+                    bins[x] = bin < maxBin ? bin : maxBin;
+                }
+                #pragma omp simd
+                for (size_t x = 0; x < w; ++x)
                 {
-                    //std::cout << "skipping index[" << static_cast<int>(x+i) <<
-                    //             " " << static_cast<int>(y+j) << "]" << std::endl;
-                    continue;
+                    const float weight = spatialWeight * lut[bins[x]];
+                    sum[x] += weight * neighbor[x];
+                    weightSum[x] += weight;
                 }
-                res += kernel.kernel.at(i+it_s + (j+it_s)*size) * in[x+i + (y+j)*w];
             }
         }
-        return res;
+
+        for (size_t x = 0; x < w; ++x)
+        {
+            image[x + w*y] = center[x] == invalidValue ? -std::numeric_limits<float>::infinity() : sum[x] / weightSum[x];
+        }
     }
+
+    // spatial gaussian in two passes over the padded image and its weights, no bounds checks or branches in the taps.
+    // the filtered weights renormalize the sum where invalid pixels were skipped
+    void filterSeparable(const float* input, float* output)
+    {
+        ThreadPool& pool = ThreadPool::global();
+        pool.parallelFor(h, [&](size_t y)
+        {
+            const float* in = &paddedImage[(y + it_s)*paddedWidth];
+            const float* inWeight = &paddedWeight[(y + it_s)*paddedWidth];
+            float* out = &horizontalImage[(y + it_s)*w];
+            float* outWeight = &horizontalWeight[(y + it_s)*w];
+
+            #pragma omp simd
+            for (size_t x = 0; x < w; ++x)
+            {
+                float sum = 0;
+                float weightSum = 0;
+                for (int i = 0; i < size; ++i)
+                {
+                    sum += separableKernel.kernel[i] * in[x + i];
+                    weightSum += separableKernel.kernel[i] * inWeight[x + i];
+                }
+                out[x] = sum;
+                outWeight[x] = weightSum;
+            }
+        });
+
+        pool.parallelFor(h, [&](size_t y)
+        {
+            const float* in = &horizontalImage[y*w];
+            const float* inWeight = &horizontalWeight[y*w];
+            // input may be output, each pixel is read before it is written
+            const float* valid = input + w*y;
+            float* out = output + w*y;
+
+            #pragma omp simd
+            for (size_t x = 0; x < w; ++x)
+            {
+                float sum = 0;
+                float weightSum = 0;
+                for (int j = 0; j < size; ++j)
+                {
+                    sum += separableKernel.kernel[j] * in[x + j*w];
+                    weightSum += separableKernel.kernel[j] * inWeight[x + j*w];
+                }
+                // a valid center has a weight of its own, so weightSum > 0
+                out[x] = std::isfinite(valid[x]) ? sum / weightSum : -std::numeric_limits<float>::infinity();
+            }
+        });
+    }
+
     // const GaussianKernel<size,sigma> kernel = GaussianKernel<size,sigma>();
     static constexpr GaussianKernel<size,sigma> kernel = GaussianKernel<size,sigma>();
+    static constexpr SeparableGaussianKernel<size,sigma> separableKernel = SeparableGaussianKernel<size,sigma>();
+    // invalid pixels and the padding in bilateral mode: any difference to a valid pixel hits the cutoff
+    static constexpr float invalidValue = std::numeric_limits<float>::max();
+    static constexpr int rangeLutSize = 256;
+    // row blocks of the bilateral filter per thread, for load balancing
+    static constexpr size_t blocksPerThread = 4;
+
     const size_t w;
     const size_t h;
     const int it_s;
-    float* tempImage;
+    const size_t paddedWidth;
+    std::vector<float> paddedImage;
+    // spatial only: weight of each entry of paddedImage, paddedImage and its weights filtered along x,
+    // with it_s rows of zeros (of weight 1) above and below
+    std::vector<float> paddedWeight;
+    std::vector<float> horizontalImage;
+    std::vector<float> horizontalWeight;
+
+    const float sigmaRange;
+    float rangeScale = 0;
+    std::array<float, rangeLutSize> rangeLut = {};
+    // bilateral only: one row of each per block of rows
+    size_t nBlocks = 1;
+    std::vector<float> rowSum;
+    std::vector<float> rowWeightSum;
+    std::vector<int> rowBins;
 };
@@ -0,0 +1,360 @@
+#pragma once
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "Eigen.h"
+#include "ThreadPool.h"
+
+// static kd-tree over 3D points for exact nearest neighbor queries within a radius.
+// the tree is complete and stored implicitly: node i has the children 2i+1 and 2i+2 and all leaves are on
+// the same level. after build, node k of level l holds the points [k*n/2^l, (k+1)*n/2^l) of the reordered
+// points, so only the split planes and the start of each leaf are stored. the points are kept as contiguous
+// x, y and z arrays in tree order, a leaf bucket is scanned with SIMD.
+// refit sorts a new set of points into the leaves of the existing split planes, which is cheaper than a
+// new build while the points move little (e.g. the next frame) and keeps the search exact.
+class KdTree
+{
+public:
+    KdTree() {}
+
+    // non finite points are left out
+    void build(const std::vector<Eigen::Vector3f>& points)
+    {
+        std::vector<int> order;
+        order.reserve(points.size());
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            if (points[i].allFinite())
+            {
+                order.push_back(i);
+            }
+        }
+        const size_t n = order.size();
+        m_nPoints = n;
+
+        m_depth = 0;
+        while ((n >> m_depth) > m_leafSize)
+        {
+            ++m_depth;
+        }
+        const size_t nInnerNodes = (size_t(1) << m_depth) - 1;
+        m_splitValue.resize(nInnerNodes);
+        m_splitAxis.resize(nInnerNodes);
+
+        // median splits level by level, the nodes of a level are independent
+        ThreadPool& pool = ThreadPool::global();
+        for (unsigned int level = 0; level < m_depth; ++level)
+        {
+            const size_t nNodes = size_t(1) << level;
+            pool.parallelFor(nNodes, [&](size_t k)
+            {
+                const size_t begin = (k * n) >> level;
+                const size_t end = ((k + 1) * n) >> level;
+                const size_t mid = ((2*k + 1) * n) >> (level + 1);
+
+                // split along the largest extent
+                Eigen::Vector3f min = Eigen::Vector3f::Constant(FLT_MAX);
+                Eigen::Vector3f max = Eigen::Vector3f::Constant(-FLT_MAX);
+                for (size_t i = begin; i < end; ++i)
+                {
+                    min = min.cwiseMin(points[order[i]]);
+                    max = max.cwiseMax(points[order[i]]);
+                }
+                int axis;
+                (max - min).maxCoeff(&axis);
+
+                std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                                 [&](int a, int b) { return points[a][axis] < points[b][axis]; });
+
+                const size_t node = nNodes - 1 + k;
+                m_splitAxis[node] = axis;
+                m_splitValue[node] = points[order[mid]][axis];
+            });
+        }
+
+        const size_t nLeaves = size_t(1) << m_depth;
+        m_leafStart.resize(nLeaves + 1);
+        for (size_t k = 0; k <= nLeaves; ++k)
+        {
+            m_leafStart[k] = (k * n) >> m_depth;
+        }
+        m_buildCost = leafCost(m_leafStart);
+
+        m_x.resize(n);
+        m_y.resize(n);
+        m_z.resize(n);
+        m_indices.resize(n);
+        m_pointLeaf.assign(points.size(), nLeaves);
+        pool.parallelFor(nLeaves, [&](size_t k)
+        {
+            for (size_t i = m_leafStart[k]; i < m_leafStart[k + 1]; ++i)
+            {
+                const Eigen::Vector3f& point = points[order[i]];
+                m_x[i] = point.x();
+                m_y[i] = point.y();
+                m_z[i] = point.z();
+                m_indices[i] = order[i];
+                m_pointLeaf[order[i]] = k;
+            }
+        });
+    }
+
+    // sort points into the leaves of the current tree, non finite points are left out.
+    // false, and the tree is unchanged, if the split planes no longer fit the points and the tree has to be
+    // built again: the leaves got too uneven (see leafCost) or a single leaf too large
+    bool refit(const std::vector<Eigen::Vector3f>& points)
+    {
+        if (m_leafStart.empty())
+        {
+            return false;
+        }
+
+        // leaf of each point, nLeaves for the left out ones
+        const size_t nLeaves = size_t(1) << m_depth;
+        const size_t firstLeaf = nLeaves - 1;
+        m_refitLeaf.resize(points.size());
+        ThreadPool::global().parallelFor(points.size(), [&](size_t i)
+        {
+            if (!points[i].allFinite())
+            {
+                m_refitLeaf[i] = nLeaves;
+                return;
+            }
+            size_t node = 0;
+            while (node < firstLeaf)
+            {
+                node = points[i][m_splitAxis[node]] < m_splitValue[node] ? 2*node + 1 : 2*node + 2;
+            }
+            m_refitLeaf[i] = node - firstLeaf;
+        });
+
+        m_refitStart.assign(nLeaves + 1, 0);
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            if (m_refitLeaf[i] < nLeaves)
+            {
+                ++m_refitStart[m_refitLeaf[i] + 1];
+            }
+        }
+        for (size_t k = 0; k < nLeaves; ++k)
+        {
+            if (m_refitStart[k + 1] > m_maxRefitLeafSize)
+            {
+                return false;
+            }
+            m_refitStart[k + 1] += m_refitStart[k];
+        }
+        if (leafCost(m_refitStart) > m_maxRefitCost * m_buildCost)
+        {
+            return false;
+        }
+        std::swap(m_leafStart, m_refitStart);
+        std::swap(m_pointLeaf, m_refitLeaf);
+
+        // stable within each leaf, the counts become the next free entry
+        const size_t n = m_leafStart[nLeaves];
+        m_nPoints = n;
+        m_x.resize(n);
+        m_y.resize(n);
+        m_z.resize(n);
+        m_indices.resize(n);
+        std::copy(m_leafStart.begin(), m_leafStart.end(), m_refitStart.begin());
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            const size_t leaf = m_pointLeaf[i];
+            if (leaf == nLeaves)
+            {
+                continue;
+            }
+            const size_t slot = m_refitStart[leaf]++;
+            m_x[slot] = points[i].x();
+            m_y[slot] = points[i].y();
+            m_z[slot] = points[i].z();
+            m_indices[slot] = i;
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_nPoints;
+    }
+
+    // index of the closest point with squared distance <= maxDistance2, -1 if there is none.
+    // on success maxDistance2 is set to the squared distance of the closest point.
+    // hint is a point index that is likely close (e.g. the match of the last ICP iteration). its leaf is
+    // scanned first, then only the smallest subtree around it that no closer point can lie outside of is
+    // searched. the result does not depend on it
+    int nearest(const Eigen::Vector3f& query, float& maxDistance2, int hint = -1) const
+    {
+        if (m_nPoints == 0 || !query.allFinite())
+        {
+            return -1;
+        }
+
+        const float q[3] = { query.x(), query.y(), query.z() };
+        const size_t firstLeaf = (size_t(1) << m_depth) - 1;
+
+        int idx = -1;
+        float best2 = maxDistance2;
+        size_t hintLeaf = SIZE_MAX;
+        size_t root = 0;
+        if (hint >= 0 && size_t(hint) < m_pointLeaf.size() && m_pointLeaf[hint] < firstLeaf + 1)
+        {
+            hintLeaf = m_pointLeaf[hint];
+            idx = scan(q, m_leafStart[hintLeaf], m_leafStart[hintLeaf + 1], best2);
+            if (idx >= 0)
+            {
+                root = enclosingNode(q, firstLeaf + hintLeaf, best2);
+                if (root >= firstLeaf)
+                {
+                    maxDistance2 = best2;
+                    return idx;
+                }
+            }
+        }
+
+        // nodes still to visit with a lower bound of their squared distance
+        struct Entry { size_t node; float distance2; };
+        Entry stack[64];
+        int top = 0;
+        stack[top++] = { root, 0.f };
+
+        while (top > 0)
+        {
+            const Entry entry = stack[--top];
+            if (entry.distance2 > best2)
+            {
+                continue;
+            }
+
+            size_t node = entry.node;
+            // descend to the leaf on the side of the query, remember the other sides
+            while (node < firstLeaf)
+            {
+                const float diff = q[m_splitAxis[node]] - m_splitValue[node];
+                const size_t left = 2*node + 1;
+                if (diff < 0)
+                {
+                    stack[top++] = { left + 1, diff * diff };
+                    node = left;
+                }
+                else
+                {
+                    stack[top++] = { left, diff * diff };
+                    node = left + 1;
+                }
+            }
+
+            const size_t k = node - firstLeaf;
+            if (k == hintLeaf)
+            {
+                continue;
+            }
+            const int leafIdx = scan(q, m_leafStart[k], m_leafStart[k + 1], best2);
+            if (leafIdx >= 0)
+            {
+                idx = leafIdx;
+            }
+        }
+
+        if (idx >= 0)
+        {
+            maxDistance2 = best2;
+        }
+        return idx;
+    }
+
+private:
+    // average number of points in the leaf of a point, i.e. the points scanned by a query near the data.
+    // leafStart as m_leafStart
+    static float leafCost(const std::vector<size_t>& leafStart)
+    {
+        double sum2 = 0;
+        for (size_t k = 0; k + 1 < leafStart.size(); ++k)
+        {
+            const double count = leafStart[k + 1] - leafStart[k];
+            sum2 += count * count;
+        }
+        return leafStart.back() > 0 ? sum2 / leafStart.back() : 0.f;
+    }
+
+    // the deepest node on the path from the root to leaf whose cell contains the ball of squared radius
+    // distance2 around q. no point outside of its subtree is that close
+    size_t enclosingNode(const float* q, size_t leaf, float distance2) const
+    {
+        size_t enclosing = 0;
+        float margin2 = FLT_MAX;
+        for (unsigned int level = 1; level <= m_depth; ++level)
+        {
+            const size_t parent = ((leaf + 1) >> (m_depth - level + 1)) - 1;
+            const size_t node = ((leaf + 1) >> (m_depth - level)) - 1;
+            const float diff = q[m_splitAxis[parent]] - m_splitValue[parent];
+            margin2 = std::min(margin2, diff * diff);
+            // q is on the other side or the ball crosses the split plane
+            if ((node == 2*parent + 1) != (diff < 0) || margin2 < distance2)
+            {
+                break;
+            }
+            enclosing = node;
+        }
+        return enclosing;
+    }
+
+    // closest point of [begin, end) with squared distance <= best2, updates best2
+    int scan(const float* q, size_t begin, size_t end, float& best2) const
+    {
+        float min2 = FLT_MAX;
+#pragma omp simd reduction(min:min2)
+        for (size_t i = begin; i < end; ++i)
+        {
+            const float ex = m_x[i] - q[0], ey = m_y[i] - q[1], ez = m_z[i] - q[2];
+            min2 = std::min(min2, ex*ex + ey*ey + ez*ez);
+        }
+        if (min2 > best2)
+        {
+            return -1;
+        }
+
+        int idx = -1;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const float ex = m_x[i] - q[0], ey = m_y[i] - q[1], ez = m_z[i] - q[2];
+            const float dist2 = ex*ex + ey*ey + ez*ez;
+            if (dist2 <= best2)
+            {
+                best2 = dist2;
+                idx = m_indices[i];
+            }
+        }
+        return idx;
+    }
+
+    // maximal number of points per leaf of a build and of a refit
+    static constexpr size_t m_leafSize = 8;
+    static constexpr size_t m_maxRefitLeafSize = 16 * m_leafSize;
+    // maximal leafCost of a refit relative to the one of the build
+    static constexpr float m_maxRefitCost = 1.5f;
+
+    size_t m_nPoints = 0;
+    unsigned int m_depth = 0;
+    std::vector<float> m_splitValue;
+    std::vector<uint8_t> m_splitAxis;
+    // leaf k holds the points [m_leafStart[k], m_leafStart[k+1]) in tree order
+    std::vector<size_t> m_leafStart;
+    float m_buildCost = 0;
+
+    // points in tree order
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_z;
+    std::vector<int> m_indices;
+    // leaf of each input point, the number of leaves if it was left out
+    std::vector<size_t> m_pointLeaf;
+
+    // refit buffers, kept between calls
+    std::vector<size_t> m_refitLeaf;
+    std::vector<size_t> m_refitStart;
+};
@@ -1,7 +1,14 @@
 #pragma once
+#include <memory>
+#include <cfloat>
+#include <cmath>
+#include <atomic>
+#include <cstdint>
 #include <flann/flann.hpp>
 
 #include "Eigen.h"
+#include "KdTree.h"
+#include "ThreadPool.h"
 
 struct Match
 {
@@ -20,9 +27,24 @@ public:
     }
 
     virtual void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints) = 0;
+    // new target points close to the indexed ones (e.g. of the next frame), an index may be refit to them
+    // instead of being built again. by default it is built again
+    virtual void updateIndex(const std::vector<Eigen::Vector3f>& targetPoints)
+    {
+        buildIndex(targetPoints);
+    }
     virtual std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints) = 0;
+    // single query, hint as in refineMatches. safe to call concurrently
+    virtual Match queryMatch(const Vector3f& transformedPoint, int hint = -1) = 0;
+    // matches of a previous query (e.g. the last ICP iteration) are updated in place and serve as hints
+    // for the new ones. by default the hints are ignored
+    virtual void refineMatches(const std::vector<Vector3f>& transformedPoints, std::vector<Match>& matches)
+    {
+        matches = queryMatches(transformedPoints);
+    }
 
 protected:
+    // euclidean distance
     float m_maxDistance;
 
     NearestNeighborSearch() : m_maxDistance{ 0.005f } {}
@@ -59,6 +81,11 @@ public:
         return matches;
     }
 
+    Match queryMatch(const Vector3f& transformedPoint, int = -1)
+    {
+        return getClosestPoint(transformedPoint);
+    }
+
 private:
     std::vector<Eigen::Vector3f> m_points;
 
@@ -90,45 +117,31 @@ private:
 
 /**
  * Nearest neighbor search using FLANN.
+ * The index views the target and query points in place (no flat copies), so the target points
+ * have to stay valid and unmoved until the next buildIndex. Result buffers are reused between queries.
+ * FLANN can only add points to an existing tree, not replace them, so updateIndex builds a new one.
  */
 class NearestNeighborSearchFlann : public NearestNeighborSearch
 {
 public:
     NearestNeighborSearchFlann()
         : NearestNeighborSearch(),
-          m_nTrees{ 1 },
-          m_index{ nullptr },
-          m_flatPoints{ nullptr }
+          m_nTrees{ 1 }
 	{ }
 
-    ~NearestNeighborSearchFlann()
-    {
-        if (m_index) {
-            delete m_flatPoints;
-            delete m_index;
-            m_flatPoints = nullptr;
-            m_index = nullptr;
-        }
-    }
-
     void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints)
     {
         std::cout << "Initializing FLANN index with " << targetPoints.size() << " points." << std::endl;
 
-        // FLANN requires that all the points be flat. Therefore we copy the points to a separate flat array.
-        m_flatPoints = new float[targetPoints.size() * 3];
-        for (size_t pointIndex = 0; pointIndex < targetPoints.size(); pointIndex++)
+        m_index.reset();
+        m_dataset = view(targetPoints);
+        if (targetPoints.empty())
         {
-            for (size_t dim = 0; dim < 3; dim++)
-            {
-                m_flatPoints[pointIndex * 3 + dim] = targetPoints[pointIndex][dim];
-            }
+            return;
         }
 
-		flann::Matrix<float> dataset(m_flatPoints, targetPoints.size(), 3);
-
 		// Building the index takes some time.
-		m_index = new flann::Index<flann::L2<float>>(dataset, flann::KDTreeIndexParams(m_nTrees));
+		m_index = std::make_unique<flann::Index<flann::L2<float>>>(m_dataset, flann::KDTreeIndexParams(m_nTrees));
 		m_index->buildIndex();
 
 		std::cout << "FLANN index created." << std::endl;
@@ -142,49 +155,335 @@ public:
 			return {};
 		}
 
-		// FLANN requires that all the points be flat. Therefore we copy the points to a separate flat array.
-		float* queryPoints = new float[transformedPoints.size() * 3];
-        for (size_t pointIndex = 0; pointIndex < transformedPoints.size(); pointIndex++)
-        {
-            for (size_t dim = 0; dim < 3; dim++)
-            {
-				queryPoints[pointIndex * 3 + dim] = transformedPoints[pointIndex][dim];
-			}
-		}
+		const size_t nMatches = transformedPoints.size();
+		m_indices.resize(nMatches);
+		m_distances.resize(nMatches);
+
+		flann::Matrix<float> query = view(transformedPoints);
+		flann::Matrix<int> indices(m_indices.data(), nMatches, 1);
+		flann::Matrix<float> distances(m_distances.data(), nMatches, 1);
 
-		flann::Matrix<float> query(queryPoints, transformedPoints.size(), 3);
-		flann::Matrix<int> indices(new int[query.rows * 1], query.rows, 1);
-		flann::Matrix<float> distances(new float[query.rows * 1], query.rows, 1);
-		
 		// Do a knn search, searching for 1 nearest point and using 16 checks.
 		flann::SearchParams searchParams{ 16 };
 		searchParams.cores = 0;
 		m_index->knnSearch(query, indices, distances, 1, searchParams);
 
 		// Filter the matches.
-		const unsigned nMatches = transformedPoints.size();
+		// FLANN returns squared distances
+		const float maxDistance2 = m_maxDistance * m_maxDistance;
 		std::vector<Match> matches;
 		matches.reserve(nMatches);
 
-        for (uint i = 0; i < nMatches; ++i) {
-			if (*distances[i] <= m_maxDistance)
-				matches.push_back(Match{ *indices[i], 1.f });
+        for (size_t i = 0; i < nMatches; ++i) {
+			if (m_distances[i] <= maxDistance2)
+				matches.push_back(Match{ m_indices[i], 1.f });
 			else
 				matches.push_back(Match{ -1, 0.f });
 		}
 
-		// Release the memory.
-		delete[] query.ptr();
-		delete[] indices.ptr();
-		delete[] distances.ptr();
-
 		return matches;
 	}
 
+    Match queryMatch(const Vector3f& transformedPoint, int = -1)
+    {
+        if (!m_index)
+        {
+            return Match{ -1, 0.f };
+        }
+
+        int index;
+        float distance;
+        flann::Matrix<float> query(const_cast<float*>(transformedPoint.data()), 1, 3);
+        flann::Matrix<int> indices(&index, 1, 1);
+        flann::Matrix<float> distances(&distance, 1, 1);
+        m_index->knnSearch(query, indices, distances, 1, flann::SearchParams{ 16 });
+
+        if (distance <= m_maxDistance * m_maxDistance)
+        {
+            return Match{ index, 1.f };
+        }
+        return Match{ -1, 0.f };
+    }
+
 private:
+    // rows of 3 floats with the stride of Vector3f, FLANN only reads through the pointer
+    static flann::Matrix<float> view(const std::vector<Eigen::Vector3f>& points)
+    {
+        float* data = points.empty() ? nullptr : const_cast<float*>(points[0].data());
+        return flann::Matrix<float>(data, points.size(), 3, sizeof(Eigen::Vector3f));
+    }
+
 	int m_nTrees;
-	flann::Index<flann::L2<float>>* m_index;
-	float* m_flatPoints;
+	std::unique_ptr<flann::Index<flann::L2<float>>> m_index;
+	flann::Matrix<float> m_dataset;
+
+	std::vector<int> m_indices;
+	std::vector<float> m_distances;
+};
+
+
+/**
+ * Nearest neighbor search on a uniform grid with cells of size m_maxDistance, which are hashed into buckets.
+ * Every neighbor within m_maxDistance lies in the 27 cells around the query, so a query scans only those.
+ * With a hint, only the cells within its distance are scanned.
+ * The points are sorted by bucket (counting sort) into contiguous x, y and z arrays.
+ * Call buildIndex again after setMatchingMaxDistance.
+ */
+class NearestNeighborSearchHashGrid : public NearestNeighborSearch
+{
+public:
+    NearestNeighborSearchHashGrid() : NearestNeighborSearch() {}
+
+    void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints)
+    {
+        const size_t nPoints = targetPoints.size();
+        m_cellSize = m_maxDistance;
+
+        // about two buckets per point
+        size_t nBuckets = 1;
+        while (nBuckets < 2*nPoints)
+        {
+            nBuckets <<= 1;
+        }
+        m_bucketMask = nBuckets - 1;
+
+        // count the points per bucket, invalid points are not sorted in
+        ThreadPool& pool = ThreadPool::global();
+        std::vector<uint32_t> pointBucket(nPoints);
+        std::vector<std::atomic<uint32_t>> count(nBuckets);
+
+        pool.parallelFor(nPoints, [&](size_t i)
+        {
+            if (!targetPoints[i].allFinite())
+            {
+                pointBucket[i] = nBuckets;
+                return;
+            }
+            const uint32_t bucket = hash(cell(targetPoints[i]));
+            pointBucket[i] = bucket;
+            count[bucket].fetch_add(1, std::memory_order_relaxed);
+        });
+
+        // exclusive prefix sum: bucket b holds the entries [m_bucketStart[b], m_bucketStart[b+1])
+        m_bucketStart.assign(nBuckets + 1, 0);
+        for (size_t b = 0; b < nBuckets; ++b)
+        {
+            m_bucketStart[b + 1] = m_bucketStart[b] + count[b].load(std::memory_order_relaxed);
+        }
+
+        const size_t nSorted = m_bucketStart[nBuckets];
+        m_x.resize(nSorted);
+        m_y.resize(nSorted);
+        m_z.resize(nSorted);
+        m_indices.resize(nSorted);
+        m_slots.assign(nPoints, -1);
+
+        // the counts become the next free entry of each bucket
+        std::vector<std::atomic<uint32_t>>& next = count;
+        for (size_t b = 0; b < nBuckets; ++b)
+        {
+            next[b].store(m_bucketStart[b], std::memory_order_relaxed);
+        }
+        pool.parallelFor(nPoints, [&](size_t i)
+        {
+            const uint32_t bucket = pointBucket[i];
+            if (bucket == nBuckets)
+            {
+                return;
+            }
+            const uint32_t slot = next[bucket].fetch_add(1, std::memory_order_relaxed);
+
+            m_x[slot] = targetPoints[i].x();
+            m_y[slot] = targetPoints[i].y();
+            m_z[slot] = targetPoints[i].z();
+            m_indices[slot] = i;
+            m_slots[i] = slot;
+        });
+    }
+
+    std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints)
+    {
+        const size_t nMatches = transformedPoints.size();
+        std::vector<Match> matches(nMatches);
+
+        ThreadPool::global().parallelFor(nMatches, [&](size_t i)
+        {
+            matches[i] = getClosestPoint(transformedPoints[i]);
+        });
+
+        return matches;
+    }
+
+    void refineMatches(const std::vector<Vector3f>& transformedPoints, std::vector<Match>& matches)
+    {
+        const size_t nMatches = transformedPoints.size();
+        matches.resize(nMatches, Match{ -1, 0.f });
+
+        ThreadPool::global().parallelFor(nMatches, [&](size_t i)
+        {
+            matches[i] = getClosestPoint(transformedPoints[i], matches[i].idx);
+        });
+    }
+
+    Match queryMatch(const Vector3f& transformedPoint, int hint = -1)
+    {
+        return getClosestPoint(transformedPoint, hint);
+    }
+
+private:
+    Eigen::Vector3i cell(const Eigen::Vector3f& p) const
+    {
+        return (p / m_cellSize).array().floor().cast<int>();
+    }
+
+    uint32_t hash(const Eigen::Vector3i& c) const
+    {
+        return ((uint32_t(c.x()) * 73856093u) ^ (uint32_t(c.y()) * 19349663u) ^ (uint32_t(c.z()) * 83492791u)) & m_bucketMask;
+    }
+
+    // hint: index of a target point expected close to p, -1 if there is none.
+    // if it is within the radius, only the cells overlapping the ball with its distance are scanned
+    Match getClosestPoint(const Vector3f& p, int hint = -1) const
+    {
+        if (m_indices.empty() || !p.allFinite())
+        {
+            return Match{ -1, 0.f };
+        }
+
+        const float px = p.x(), py = p.y(), pz = p.z();
+        const Eigen::Vector3i center = cell(p);
+
+        int idx = -1;
+        float minDist2 = m_maxDistance * m_maxDistance;
+        if (hint >= 0 && hint < static_cast<int>(m_slots.size()) && m_slots[hint] >= 0)
+        {
+            const int slot = m_slots[hint];
+            const float ex = m_x[slot] - px, ey = m_y[slot] - py, ez = m_z[slot] - pz;
+            const float dist2 = ex*ex + ey*ey + ez*ez;
+            if (dist2 <= minDist2)
+            {
+                minDist2 = dist2;
+                idx = hint;
+            }
+        }
+
+        // range of neighboring cells overlapping the ball, within [-1, 1] as the radius is at most the cell size
+        const float radius = std::sqrt(minDist2);
+        const Eigen::Vector3i first = cell(p - Eigen::Vector3f::Constant(radius)).cwiseMax(center - Eigen::Vector3i::Ones()) - center;
+        const Eigen::Vector3i last = cell(p + Eigen::Vector3f::Constant(radius)).cwiseMin(center + Eigen::Vector3i::Ones()) - center;
+
+        for (int dz = first.z(); dz <= last.z(); ++dz)
+        {
+            for (int dy = first.y(); dy <= last.y(); ++dy)
+            {
+                for (int dx = first.x(); dx <= last.x(); ++dx)
+                {
+                    const uint32_t bucket = hash(center + Eigen::Vector3i(dx, dy, dz));
+                    const uint32_t begin = m_bucketStart[bucket];
+                    const uint32_t end = m_bucketStart[bucket + 1];
+
+                    // closest distance in the bucket, vectorized over the candidates
+                    float bucketMin2 = FLT_MAX;
+#pragma omp simd reduction(min:bucketMin2)
+                    for (uint32_t j = begin; j < end; ++j)
+                    {
+                        const float ex = m_x[j] - px, ey = m_y[j] - py, ez = m_z[j] - pz;
+                        bucketMin2 = std::min(bucketMin2, ex*ex + ey*ey + ez*ez);
+                    }
+                    if (bucketMin2 > minDist2)
+                    {
+                        continue;
+                    }
+
+                    // only buckets which improve the match are searched for the index
+                    for (uint32_t j = begin; j < end; ++j)
+                    {
+                        const float ex = m_x[j] - px, ey = m_y[j] - py, ez = m_z[j] - pz;
+                        const float dist2 = ex*ex + ey*ey + ez*ez;
+                        if (dist2 <= minDist2)
+                        {
+                            minDist2 = dist2;
+                            idx = m_indices[j];
+                        }
+                    }
+                }
+            }
+        }
+
+        if (idx >= 0)
+        {
+            return Match{ idx, 1.f };
+        }
+        return Match{ -1, 0.f };
+    }
+
+    float m_cellSize = 0.f;
+    uint32_t m_bucketMask = 0;
+    std::vector<uint32_t> m_bucketStart;
+
+    // sorted by bucket
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_z;
+    std::vector<int> m_indices;
+    // sorted position of each target point, -1 if left out
+    std::vector<int> m_slots;
 };
 
 
+/**
+ * Exact nearest neighbor search within m_maxDistance using a static kd-tree (see KdTree.h).
+ */
+class NearestNeighborSearchKdTree : public NearestNeighborSearch
+{
+public:
+    NearestNeighborSearchKdTree() : NearestNeighborSearch() {}
+
+    void buildIndex(const std::vector<Eigen::Vector3f>& targetPoints)
+    {
+        m_tree.build(targetPoints);
+    }
+
+    // the points are sorted into the existing tree while it stays balanced
+    void updateIndex(const std::vector<Eigen::Vector3f>& targetPoints)
+    {
+        if (!m_tree.refit(targetPoints))
+        {
+            m_tree.build(targetPoints);
+        }
+    }
+
+    std::vector<Match> queryMatches(const std::vector<Vector3f>& transformedPoints)
+    {
+        const size_t nMatches = transformedPoints.size();
+        std::vector<Match> matches(nMatches);
+
+        ThreadPool::global().parallelFor(nMatches, [&](size_t i)
+        {
+            matches[i] = queryMatch(transformedPoints[i]);
+        });
+
+        return matches;
+    }
+
+    void refineMatches(const std::vector<Vector3f>& transformedPoints, std::vector<Match>& matches)
+    {
+        const size_t nMatches = transformedPoints.size();
+        matches.resize(nMatches, Match{ -1, 0.f });
+
+        ThreadPool::global().parallelFor(nMatches, [&](size_t i)
+        {
+            matches[i] = queryMatch(transformedPoints[i], matches[i].idx);
+        });
+    }
+
+    Match queryMatch(const Vector3f& transformedPoint, int hint = -1)
+    {
+        float distance2 = m_maxDistance * m_maxDistance;
+        const int idx = m_tree.nearest(transformedPoint, distance2, hint);
+        return idx >= 0 ? Match{ idx, 1.f } : Match{ -1, 0.f };
+    }
+
+private:
+    KdTree m_tree;
+};
@@ -0,0 +1,105 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// bounded queue between one producer and one consumer thread, without locks.
+// the ring buffer has one slot more than the capacity, so full and empty can be told apart.
+// m_tail is only written by the producer and m_head only by the consumer, each on its own cache line.
+// the blocking push and pop yield while waiting, close() lets them fail instead, e.g. to shut down a pipeline
+template<typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+        : m_buffer(capacity + 1)
+    {}
+
+    // false if the queue is full, value is only moved from on success
+    bool tryPush(T& value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t next = increment(tail);
+        if (next == m_head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        m_buffer[tail] = std::move(value);
+        m_tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // false if the queue is empty
+    bool tryPop(T& value)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = std::move(m_buffer[head]);
+        m_head.store(increment(head), std::memory_order_release);
+        return true;
+    }
+
+    // waits for a free slot, false if the queue was closed
+    bool push(T value)
+    {
+        while (!closed())
+        {
+            if (tryPush(value))
+            {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    // waits for an element, false if the queue was closed
+    bool pop(T& value)
+    {
+        while (!closed())
+        {
+            if (tryPop(value))
+            {
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    // wake up waiting and fail all following blocking calls
+    void close()
+    {
+        m_closed.store(true, std::memory_order_release);
+    }
+
+    bool closed() const
+    {
+        return m_closed.load(std::memory_order_acquire);
+    }
+
+    // only a snapshot, the other thread may change it right away
+    bool empty() const
+    {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return m_buffer.size() - 1;
+    }
+
+private:
+    size_t increment(size_t idx) const
+    {
+        return idx + 1 == m_buffer.size() ? 0 : idx + 1;
+    }
+
+    std::vector<T> m_buffer;
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    std::atomic<bool> m_closed{false};
+};
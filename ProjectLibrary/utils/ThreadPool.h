@@ -0,0 +1,293 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+// long lived worker threads for the frame pipeline and the data parallel kernels.
+// every worker has its own task deque: it runs its newest task first and steals the oldest task of another
+// worker when its deque is empty. idle workers sleep until a task is submitted.
+// loops are split by parallelFor, the calling thread works on its loop as well and runs pending tasks while it
+// waits for the rest. so loops can be nested in tasks or in other loops, and waiting never blocks a worker.
+class ThreadPool
+{
+public:
+    // if pinThreads is set, worker i only runs on core i (modulo the number of cores), linux only
+    explicit ThreadPool(size_t nThreads, bool pinThreads = false)
+        : m_workers(nThreads)
+    {
+        for (size_t i = 0; i < nThreads; ++i)
+        {
+            m_workers[i].thread = std::thread(&ThreadPool::work, this, i, pinThreads);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // pending tasks are still run
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_wakeUp.notify_all();
+        for (auto& worker : m_workers)
+        {
+            worker.thread.join();
+        }
+    }
+
+    // the pool shared by all models and kernels of the process, created on first use.
+    // it has one worker less than there are cores, the thread driving a model takes part in its loops
+    static ThreadPool& global()
+    {
+        std::lock_guard<std::mutex> lock(globalMutex());
+        if (!globalPool())
+        {
+            globalPool() = std::make_unique<ThreadPool>(std::max(2u, std::thread::hardware_concurrency()) - 1);
+        }
+        return *globalPool();
+    }
+
+    // create the global pool with other settings, false if it exists already
+    static bool configureGlobal(size_t nThreads, bool pinThreads)
+    {
+        std::lock_guard<std::mutex> lock(globalMutex());
+        if (globalPool())
+        {
+            return false;
+        }
+        globalPool() = std::make_unique<ThreadPool>(nThreads, pinThreads);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_workers.size();
+    }
+
+    // run task on a worker
+    void run(std::function<void()> task)
+    {
+        // workers queue their own tasks, the other threads distribute them round robin
+        const Identity& self = identity();
+        const size_t idx = self.pool == this ? self.idx : m_nextWorker.fetch_add(1, std::memory_order_relaxed) % size();
+        // counted first, so the count never drops below zero when the task is taken right away
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            ++m_pending;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_workers[idx].mutex);
+            m_workers[idx].tasks.push_back(std::move(task));
+        }
+        m_wakeUp.notify_one();
+    }
+
+    // run task on a worker, the future gets ready when it is done
+    std::future<void> submit(std::function<void()> task)
+    {
+        auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+        std::future<void> future = packaged->get_future();
+        run([packaged]() { (*packaged)(); });
+        return future;
+    }
+
+    // fn(begin, end) on consecutive ranges covering [0, n), in parallel. returns when all ranges are done.
+    // the ranges are handed out one by one, so uneven work per index is balanced
+    template<typename Function>
+    void parallelForRange(size_t n, Function fn)
+    {
+        const size_t nChunks = std::min(n, m_chunksPerThread * (size() + 1));
+        if (nChunks <= 1)
+        {
+            if (n > 0)
+            {
+                fn(size_t(0), n);
+            }
+            return;
+        }
+
+        struct Loop
+        {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+        };
+        auto loop = std::make_shared<Loop>();
+        // helpers that start after all chunks are taken return without touching fn
+        auto runChunks = [loop, nChunks, n, &fn]()
+        {
+            size_t chunk;
+            while ((chunk = loop->next.fetch_add(1, std::memory_order_relaxed)) < nChunks)
+            {
+                fn(chunk * n / nChunks, (chunk + 1) * n / nChunks);
+                loop->done.fetch_add(1, std::memory_order_release);
+            }
+        };
+
+        const size_t nHelpers = std::min(size(), nChunks - 1);
+        for (size_t i = 0; i < nHelpers; ++i)
+        {
+            run(runChunks);
+        }
+        runChunks();
+        // the remaining chunks are being worked on, meanwhile help with other tasks
+        waitUntil([&loop, nChunks]() { return loop->done.load(std::memory_order_acquire) >= nChunks; });
+    }
+
+    // fn(i) for all i in [0, n), in parallel
+    template<typename Function>
+    void parallelFor(size_t n, Function fn)
+    {
+        parallelForRange(n, [&fn](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                fn(i);
+            }
+        });
+    }
+
+    // run pending tasks on the calling thread until ready() holds
+    template<typename Predicate>
+    void waitUntil(Predicate ready)
+    {
+        const Identity& self = identity();
+        const size_t idx = self.pool == this ? self.idx : size();
+        while (!ready())
+        {
+            if (!runPending(idx))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    // the worker the calling thread belongs to, if any
+    struct Identity
+    {
+        const ThreadPool* pool = nullptr;
+        size_t idx = 0;
+    };
+
+    static Identity& identity()
+    {
+        static thread_local Identity self;
+        return self;
+    }
+
+    static std::mutex& globalMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::unique_ptr<ThreadPool>& globalPool()
+    {
+        static std::unique_ptr<ThreadPool> pool;
+        return pool;
+    }
+
+    // run one task: the newest of worker self, else the oldest of another worker.
+    // self is size() for threads outside of the pool, which only steal
+    bool runPending(size_t self)
+    {
+        std::function<void()> task;
+        if (self < size())
+        {
+            std::lock_guard<std::mutex> lock(m_workers[self].mutex);
+            if (!m_workers[self].tasks.empty())
+            {
+                task = std::move(m_workers[self].tasks.back());
+                m_workers[self].tasks.pop_back();
+            }
+        }
+        for (size_t k = 1; !task && k <= size(); ++k)
+        {
+            Worker& victim = m_workers[(self + k) % size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+        }
+        if (!task)
+        {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            --m_pending;
+        }
+        task();
+        return true;
+    }
+
+    void work(size_t idx, bool pinThread)
+    {
+        identity() = {this, idx};
+#ifdef __linux__
+        if (pinThread)
+        {
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            CPU_SET(idx % std::max(1u, std::thread::hardware_concurrency()), &cores);
+            pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+        }
+#endif
+#ifdef _OPENMP
+        // openmp regions inside of tasks stay on their worker, the pool keeps the cores busy already
+        omp_set_num_threads(1);
+#endif
+
+        while (true)
+        {
+            if (runPending(idx))
+            {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wakeUp.wait(lock, [this]() { return m_stop || m_pending > 0; });
+            if (m_stop && m_pending == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    // chunks of a parallel loop per thread, for load balancing
+    static constexpr size_t m_chunksPerThread = 4;
+
+    std::vector<Worker> m_workers;
+    std::atomic<size_t> m_nextWorker{0};
+
+    // queued tasks, idle workers sleep while there are none
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wakeUp;
+    size_t m_pending = 0;
+    bool m_stop = false;
+};
@@ -0,0 +1,181 @@
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <random>
+
+#include "VirtualSensor.h"
+#include "SurfaceMeasurer.h"
+#include "NearestNeighbor.h"
+
+// compares the nearest neighbor backends on two frames of the dataset:
+// index the points of the first frame and match the points of a later frame against them
+// (camera coordinates, as for tracking with the previous pose)
+
+static PointCloud measureFrame(VirtualSensor& sensor)
+{
+    SurfaceMeasurer measurer(sensor.getDepthIntrinsics(), sensor.getDepthImageHeight(), sensor.getDepthImageWidth());
+    measurer.registerInput(sensor.getDepth());
+    measurer.process();
+    PointCloud pointCloud;
+    measurer.getSurfaceMap().compact(pointCloud);
+    return pointCloud;
+}
+
+static double milliseconds(const std::function<void()>& function, int nRepetitions)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < nRepetitions; ++i)
+    {
+        function();
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / nRepetitions;
+}
+
+static std::vector<Match> run(const std::string& name, NearestNeighborSearch& search, const std::vector<Vector3f>& target,
+                              const std::vector<Vector3f>& queries, int nRepetitions)
+{
+    std::vector<Match> matches;
+    const double buildTime = milliseconds([&]() { search.buildIndex(target); }, nRepetitions);
+    const double queryTime = milliseconds([&]() { matches = search.queryMatches(queries); }, nRepetitions);
+
+    size_t nMatched = 0;
+    for (const auto& match : matches)
+    {
+        nMatched += match.idx >= 0;
+    }
+    // a later ICP iteration: the last matches are the hints
+    std::vector<Match> refined;
+    const double refineTime = milliseconds([&]() { refined = matches; search.refineMatches(queries, refined); }, nRepetitions);
+
+    std::cout << name << ": build " << buildTime << " ms, query " << queryTime << " ms ("
+              << 1e6 * queryTime / queries.size() << " ns per point), warm started query " << refineTime << " ms, "
+              << nMatched << " of " << queries.size() << " matched" << std::endl;
+    return matches;
+}
+
+// queries of a late ICP iteration: cold, and warm started from the matches of the iteration before
+static void runWarmStart(const std::string& name, NearestNeighborSearch& search, const std::vector<Vector3f>& target,
+                         const std::vector<Vector3f>& queries, const std::vector<Vector3f>& previousQueries, int nRepetitions)
+{
+    search.buildIndex(target);
+    const std::vector<Match> hints = search.queryMatches(previousQueries);
+    std::vector<Match> matches;
+    const double queryTime = milliseconds([&]() { matches = search.queryMatches(queries); }, nRepetitions);
+    std::vector<Match> refined;
+    const double refineTime = milliseconds([&]() { refined = hints; search.refineMatches(queries, refined); }, nRepetitions);
+
+    size_t nEqual = 0;
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        nEqual += matches[i].idx == refined[i].idx;
+    }
+    std::cout << name << ": query " << queryTime << " ms, warm started query " << refineTime << " ms, "
+              << nEqual << " of " << queries.size() << " equal" << std::endl;
+}
+
+// fraction of queries with the same result as the reference
+static float agreement(const std::vector<Match>& matches, const std::vector<Match>& reference)
+{
+    size_t nEqual = 0;
+    for (size_t i = 0; i < reference.size(); ++i)
+    {
+        nEqual += matches[i].idx == reference[i].idx;
+    }
+    return float(nEqual) / reference.size();
+}
+
+int main(int argc, char* argv[])
+{
+    std::string filenameIn = std::string("../kifu/data/rgbd_dataset_freiburg1_xyz/");
+
+    std::filesystem::path executableFolderPath =  std::filesystem::canonical("/proc/self/exe").parent_path();
+    std::filesystem::path dataFolderLocation = argc > 1 ? std::filesystem::path(argv[1]) : executableFolderPath.parent_path() / filenameIn;
+
+    VirtualSensor sensor;
+    if (!sensor.init(dataFolderLocation))
+    {
+        std::cout << "Failed to initialize the sensor!\nCheck file path!" << std::endl;
+        return -1;
+    }
+
+    // target: first frame, queries: fifth frame
+    sensor.processNextFrame();
+    const PointCloud target = measureFrame(sensor);
+    sensor.processNextFrame();
+    const PointCloud nextTarget = measureFrame(sensor);
+    for (int i = 0; i < 3; ++i)
+    {
+        sensor.processNextFrame();
+    }
+    const PointCloud source = measureFrame(sensor);
+
+    // brute force is only feasible on a subset of the queries
+    std::vector<Vector3f> subset;
+    for (size_t i = 0; i < source.points.size(); i += 64)
+    {
+        subset.push_back(source.points[i]);
+    }
+
+    const int nRepetitions = 5;
+    for (float maxDistance : {0.005f, 0.02f})
+    {
+        std::cout << "max distance " << maxDistance << " m, " << target.points.size() << " target points" << std::endl;
+
+        NearestNeighborSearchFlann flann;
+        NearestNeighborSearchHashGrid hashGrid;
+        NearestNeighborSearchKdTree kdTree;
+        NearestNeighborSearchBruteForce bruteForce;
+        flann.setMatchingMaxDistance(maxDistance);
+        hashGrid.setMatchingMaxDistance(maxDistance);
+        kdTree.setMatchingMaxDistance(maxDistance);
+        bruteForce.setMatchingMaxDistance(maxDistance);
+
+        run("flann", flann, target.points, source.points, nRepetitions);
+        run("hash grid", hashGrid, target.points, source.points, nRepetitions);
+        run("kd-tree", kdTree, target.points, source.points, nRepetitions);
+
+        const auto reference = run("brute force (subset)", bruteForce, target.points, subset, 1);
+        const auto flannSubset = flann.queryMatches(subset);
+        const auto hashGridSubset = hashGrid.queryMatches(subset);
+        const auto kdTreeSubset = kdTree.queryMatches(subset);
+        std::cout << "agreement with brute force: flann " << agreement(flannSubset, reference)
+                  << ", hash grid " << agreement(hashGridSubset, reference)
+                  << ", kd-tree " << agreement(kdTreeSubset, reference) << std::endl;
+    }
+
+    // late ICP iterations: the source is aligned to the target up to noise, the previous iteration had
+    // the points about a millimeter away
+    std::mt19937 generator(42);
+    std::normal_distribution<float> noise(0.f, 0.0005f);
+    std::vector<Vector3f> aligned = target.points;
+    for (auto& point : aligned)
+    {
+        point += Vector3f(noise(generator), noise(generator), noise(generator));
+    }
+    std::vector<Vector3f> previous = aligned;
+    for (auto& point : previous)
+    {
+        point += Vector3f(0.001f, -0.0005f, 0.0005f);
+    }
+    std::cout << "aligned queries" << std::endl;
+    NearestNeighborSearchHashGrid hashGrid;
+    NearestNeighborSearchKdTree kdTree;
+    hashGrid.setMatchingMaxDistance(0.02f);
+    kdTree.setMatchingMaxDistance(0.02f);
+    runWarmStart("hash grid", hashGrid, target.points, aligned, previous, nRepetitions);
+    runWarmStart("kd-tree", kdTree, target.points, aligned, previous, nRepetitions);
+
+    // the target of the next frame: the kd-tree of the first frame is refit to it, back and forth
+    KdTree tree;
+    const double buildTime = milliseconds([&]() { tree.build(nextTarget.points); }, nRepetitions);
+    bool refit = true;
+    const double refitTime = milliseconds([&]()
+    {
+        refit &= tree.refit(target.points);
+        refit &= tree.refit(nextTarget.points);
+    }, nRepetitions) / 2;
+    std::cout << "kd-tree of the next frame: build " << buildTime << " ms, refit " << refitTime << " ms"
+              << (refit ? "" : " (refit failed)") << std::endl;
+
+    return 0;
+}
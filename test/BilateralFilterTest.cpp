@@ -157,3 +157,136 @@ TEST_F(BilateralFilterTest, TestFilterSize3)
     EXPECT_FLOAT_EQ(m_img[4], gauss_weight(0,0,sigma) / normalization_constant(kernel_size, sigma));
 }
 
+TEST(GaussianKernelTest, TestSeparable)
+{
+    constexpr auto kernel = GaussianKernel<5,2>();
+    constexpr auto separable = SeparableGaussianKernel<5,2>();
+
+    for(int x = 0; x < 5; ++x)
+    {
+        for(int y = 0; y < 5; ++y)
+        {
+            EXPECT_FLOAT_EQ(kernel.kernel.at(x + 5*y), separable.kernel.at(x) * separable.kernel.at(y));
+        }
+    }
+}
+
+TEST(BilateralFilterSpatialTest, TestSeparableMatchesKernel)
+{
+    // the two pass filter gives the zero padded 5x5 convolution, invalid pixels are skipped and the
+    // weights of the others renormalized
+    constexpr size_t w = 9, h = 7;
+    constexpr int sigma = 2;
+    std::vector<float> img(w*h);
+    for(size_t i = 0; i < img.size(); ++i)
+    {
+        img[i] = 1.f + 0.1f * float((i * 7) % 11);
+    }
+    const float minf = -std::numeric_limits<float>::infinity();
+    img[4 + w*3] = minf;
+    const std::vector<float> input = img;
+
+    auto filter = BilateralFilter<5,sigma>(w, h);
+    filter.apply(img.data());
+
+    const float norm = normalization_constant(5, sigma);
+    for(int y = 0; y < int(h); ++y)
+    {
+        for(int x = 0; x < int(w); ++x)
+        {
+            float expected = 0;
+            float weightSum = 0;
+            for(int dy = -2; dy <= 2; ++dy)
+            {
+                for(int dx = -2; dx <= 2; ++dx)
+                {
+                    const int nx = x + dx, ny = y + dy;
+                    const bool inside = nx >= 0 && nx < int(w) && ny >= 0 && ny < int(h);
+                    if(inside && input[nx + w*ny] == minf)
+                    {
+                        continue;
+                    }
+                    const float weight = gauss_weight(dx, dy, sigma) / norm;
+                    expected += inside ? weight * input[nx + w*ny] : 0.f;
+                    weightSum += weight;
+                }
+            }
+            expected /= weightSum;
+            if(input[x + w*y] == minf)
+            {
+                EXPECT_EQ(img[x + w*y], minf);
+            }
+            else
+            {
+                EXPECT_NEAR(img[x + w*y], expected, 1e-5f);
+            }
+        }
+    }
+}
+
+TEST(BilateralFilterSpatialTest, TestInvalidDoesNotSpread)
+{
+    // an invalid pixel only stays invalid itself and does not change its neighbors
+    // (unlike the old spatial filter, which made the whole 5x5 neighborhood -inf)
+    constexpr size_t w = 9, h = 7;
+    std::vector<float> img(w*h, 1.f);
+    const float minf = -std::numeric_limits<float>::infinity();
+    img[4 + w*3] = minf;
+
+    auto filter = BilateralFilter<5,2>(w, h);
+    filter.apply(img.data());
+
+    EXPECT_EQ(img[4 + w*3], minf);
+    for(size_t i = 0; i < img.size(); ++i)
+    {
+        if(i != 4 + w*3)
+        {
+            EXPECT_TRUE(std::isfinite(img[i]));
+        }
+    }
+    // away from the zero padded border the constant image stays constant
+    for(size_t y = 2; y < h - 2; ++y)
+    {
+        for(size_t x = 2; x < w - 2; ++x)
+        {
+            if(x != 4 || y != 3)
+            {
+                EXPECT_NEAR(img[x + w*y], 1.f, 1e-5f);
+            }
+        }
+    }
+}
+
+TEST(BilateralFilterRangeTest, TestEdgePreserving)
+{
+    // depth step from 1 m to 2 m between column 3 and 4 with noise and an invalid pixel
+    constexpr size_t w = 8, h = 6;
+    std::vector<float> img(w*h);
+    for(size_t y = 0; y < h; ++y)
+    {
+        for(size_t x = 0; x < w; ++x)
+        {
+            img[x + w*y] = (x < 4 ? 1.f : 2.f) + ((x + y) % 2 ? 0.005f : -0.005f);
+        }
+    }
+    const float minf = -std::numeric_limits<float>::infinity();
+    img[2 + w*2] = minf;
+
+    auto filter = BilateralFilter<5,2>(w, h, 0.01f);
+    filter.apply(img.data());
+
+    EXPECT_EQ(img[2 + w*2], minf);
+    for(size_t y = 0; y < h; ++y)
+    {
+        for(size_t x = 0; x < w; ++x)
+        {
+            if(x == 2 && y == 2)
+            {
+                continue;
+            }
+            // the edge is kept, the noise is reduced
+            const float expected = x < 4 ? 1.f : 2.f;
+            EXPECT_NEAR(img[x + w*y], expected, 0.004f);
+        }
+    }
+}
@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "NearestNeighbor.h"
+
+static void randomPoints(std::vector<Vector3f>& targetPoints, std::vector<Vector3f>& queryPoints, size_t nPoints)
+{
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> coordinate(-0.1f, 0.1f);
+    std::normal_distribution<float> offset(0.f, 0.005f);
+
+    targetPoints.resize(nPoints);
+    for (auto& point : targetPoints)
+    {
+        point = Vector3f(coordinate(generator), coordinate(generator), coordinate(generator));
+    }
+    queryPoints.clear();
+    for (size_t i = 0; i < targetPoints.size(); i += 4)
+    {
+        queryPoints.push_back(targetPoints[i] + Vector3f(offset(generator), offset(generator), offset(generator)));
+    }
+    // invalid query
+    queryPoints.push_back(Vector3f(MINF, MINF, MINF));
+}
+
+static void expectBruteForceMatches(NearestNeighborSearch& search, size_t nPoints)
+{
+    std::vector<Vector3f> targetPoints;
+    std::vector<Vector3f> queryPoints;
+    randomPoints(targetPoints, queryPoints, nPoints);
+
+    NearestNeighborSearchBruteForce bruteForce;
+    bruteForce.setMatchingMaxDistance(0.01f);
+    search.setMatchingMaxDistance(0.01f);
+    bruteForce.buildIndex(targetPoints);
+    search.buildIndex(targetPoints);
+
+    const auto expected = bruteForce.queryMatches(queryPoints);
+    const auto matches = search.queryMatches(queryPoints);
+
+    ASSERT_EQ(matches.size(), queryPoints.size());
+    size_t nMatched = 0;
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        EXPECT_EQ(matches[i].idx, expected[i].idx);
+        nMatched += matches[i].idx >= 0;
+    }
+    EXPECT_LT(matches.back().idx, 0);
+    EXPECT_GT(nMatched, queryPoints.size() / 2);
+}
+
+TEST(NearestNeighborTest, TestHashGridMatchesBruteForce)
+{
+    NearestNeighborSearchHashGrid hashGrid;
+    expectBruteForceMatches(hashGrid, 2000);
+}
+
+TEST(NearestNeighborTest, TestKdTreeMatchesBruteForce)
+{
+    NearestNeighborSearchKdTree kdTree;
+    expectBruteForceMatches(kdTree, 2000);
+    // a single leaf
+    expectBruteForceMatches(kdTree, 5);
+}
+
+static void expectWarmStartMatches(NearestNeighborSearch& search)
+{
+    std::vector<Vector3f> targetPoints;
+    std::vector<Vector3f> queryPoints;
+    randomPoints(targetPoints, queryPoints, 2000);
+
+    search.setMatchingMaxDistance(0.01f);
+    search.buildIndex(targetPoints);
+
+    // hints from slightly moved queries
+    std::vector<Vector3f> movedPoints = queryPoints;
+    for (auto& point : movedPoints)
+    {
+        point += Vector3f(0.002f, -0.001f, 0.001f);
+    }
+    std::vector<Match> matches = search.queryMatches(movedPoints);
+    search.refineMatches(queryPoints, matches);
+
+    // the hints do not change the result, neither do arbitrary ones
+    const auto expected = search.queryMatches(queryPoints);
+    ASSERT_EQ(matches.size(), expected.size());
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        EXPECT_EQ(matches[i].idx, expected[i].idx);
+        EXPECT_EQ(search.queryMatch(queryPoints[i], i).idx, expected[i].idx);
+    }
+}
+
+TEST(NearestNeighborTest, TestHashGridWarmStart)
+{
+    NearestNeighborSearchHashGrid search;
+    expectWarmStartMatches(search);
+}
+
+TEST(NearestNeighborTest, TestKdTreeWarmStart)
+{
+    NearestNeighborSearchKdTree search;
+    expectWarmStartMatches(search);
+}
+
+TEST(NearestNeighborTest, TestKdTreeRefit)
+{
+    std::vector<Vector3f> targetPoints;
+    std::vector<Vector3f> queryPoints;
+    randomPoints(targetPoints, queryPoints, 2000);
+
+    NearestNeighborSearchKdTree search;
+    search.setMatchingMaxDistance(0.01f);
+    search.buildIndex(targetPoints);
+
+    // the next target: moved a little, some points lost and some new ones
+    std::mt19937 generator(7);
+    std::normal_distribution<float> offset(0.f, 0.002f);
+    std::vector<Vector3f> movedPoints;
+    for (size_t i = 0; i < targetPoints.size(); ++i)
+    {
+        if (i % 10 != 0)
+        {
+            movedPoints.push_back(targetPoints[i] + Vector3f(offset(generator), offset(generator), offset(generator)));
+        }
+    }
+    for (size_t i = 0; i < 100; ++i)
+    {
+        movedPoints.push_back(targetPoints[i] + Vector3f(0.003f, 0.f, 0.f));
+    }
+    movedPoints.push_back(Vector3f(MINF, MINF, MINF));
+
+    KdTree tree;
+    tree.build(targetPoints);
+    ASSERT_TRUE(tree.refit(movedPoints));
+    EXPECT_EQ(tree.size(), movedPoints.size() - 1);
+
+    // the refit index is exact
+    search.updateIndex(movedPoints);
+    NearestNeighborSearchBruteForce bruteForce;
+    bruteForce.setMatchingMaxDistance(0.01f);
+    bruteForce.buildIndex(movedPoints);
+    const auto expected = bruteForce.queryMatches(queryPoints);
+    const auto matches = search.queryMatches(queryPoints);
+    ASSERT_EQ(matches.size(), expected.size());
+    for (size_t i = 0; i < matches.size(); ++i)
+    {
+        EXPECT_EQ(matches[i].idx, expected[i].idx);
+    }
+
+    // points that do not fit the split planes any more
+    std::vector<Vector3f> collapsedPoints(targetPoints.size(), Vector3f(0.05f, 0.05f, 0.05f));
+    EXPECT_FALSE(tree.refit(collapsedPoints));
+    EXPECT_EQ(tree.size(), movedPoints.size() - 1);
+}
@@ -0,0 +1,258 @@
+#include <gtest/gtest.h>
+#include "PoseEstimator.h"
+
+// renders the inside of a box corner (walls at x = 0.8, y = 0.6 and z = 2) from cameraToWorld
+// points and normals are in world coordinates
+static void renderCorner(SurfaceMap& surfaceMap, const Matrix3f& intrinsics, const Matrix4f& cameraToWorld)
+{
+    const Vector3f walls(0.8f, 0.6f, 2.f);
+    const Matrix3f rotation = cameraToWorld.block<3,3>(0,0);
+    const Vector3f origin = cameraToWorld.block<3,1>(0,3);
+
+    for(size_t y = 0; y < surfaceMap.height(); ++y)
+    {
+        for(size_t x = 0; x < surfaceMap.width(); ++x)
+        {
+            const size_t idx = y*surfaceMap.width() + x;
+            const Vector3f dir = rotation * intrinsics.inverse() * Vector3f(x, y, 1);
+
+            float t = std::numeric_limits<float>::max();
+            int wall = -1;
+            for(int dim = 0; dim < 3; ++dim)
+            {
+                const float t_dim = (walls[dim] - origin[dim]) / dir[dim];
+                if(dir[dim] > 0 && t_dim < t)
+                {
+                    t = t_dim;
+                    wall = dim;
+                }
+            }
+            surfaceMap.setInvalid(idx);
+            if(wall < 0)
+            {
+                continue;
+            }
+            surfaceMap.setPoint(idx, origin + t*dir);
+            surfaceMap.setNormal(idx, -Vector3f::Unit(wall));
+        }
+    }
+}
+
+class PoseEstimatorTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        m_intrinsics << 131.25f, 0, 79.5f,
+                        0, 131.25f, 59.5f,
+                        0, 0, 1;
+
+        m_truePose = Matrix4f::Identity();
+        m_truePose.block<3,3>(0,0) = AngleAxisf(0.03f, Vector3f(1, 2, 0.5f).normalized()).toRotationMatrix();
+        m_truePose.block<3,1>(0,3) = Vector3f(0.02f, -0.01f, 0.03f);
+
+        m_target.resize(120, 160);
+        renderCorner(m_target, m_intrinsics, Matrix4f::Identity());
+
+        m_organizedSource = measure(120, 160, m_intrinsics);
+        for(size_t i = 0; i < m_organizedSource.points.size(); ++i)
+        {
+            if(m_organizedSource.pointsValid[i] && m_organizedSource.normalsValid[i])
+            {
+                m_sourcePoints.push_back(m_organizedSource.points[i]);
+                m_sourceNormals.push_back(m_organizedSource.normals[i]);
+            }
+        }
+    }
+
+    // measured frame: organized points and normals in the coordinates of the moved camera
+    PointCloud measure(size_t height, size_t width, const Matrix3f& intrinsics) const
+    {
+        SurfaceMap measured(height, width);
+        renderCorner(measured, intrinsics, m_truePose);
+        const Matrix3f worldToCamera = m_truePose.block<3,3>(0,0).transpose();
+        PointCloud pointCloud(measured.size());
+        for(size_t i = 0; i < measured.size(); ++i)
+        {
+            pointCloud.points[i] = worldToCamera * (measured.point(i) - m_truePose.block<3,1>(0,3));
+            pointCloud.normals[i] = worldToCamera * measured.normal(i);
+            pointCloud.pointsValid[i] = measured.pointValid(i);
+            pointCloud.normalsValid[i] = measured.normalValid(i);
+        }
+        return pointCloud;
+    }
+
+    void expectPose(const Matrix4f& estimatedPose, float tolerance = 1e-3f) const
+    {
+        EXPECT_LT((estimatedPose.block<3,1>(0,3) - m_truePose.block<3,1>(0,3)).norm(), tolerance);
+        EXPECT_LT((estimatedPose.block<3,3>(0,0) - m_truePose.block<3,3>(0,0)).norm(), tolerance);
+    }
+
+    Matrix3f m_intrinsics;
+    Matrix4f m_truePose;
+    SurfaceMap m_target;
+    std::vector<Vector3f> m_sourcePoints;
+    std::vector<Vector3f> m_sourceNormals;
+    // measured frame as organized 120x160 PointCloud
+    PointCloud m_organizedSource;
+};
+
+TEST_F(PoseEstimatorTest, TestNearestNeighbor)
+{
+    NearestNeighborPoseEstimator estimator;
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSource(m_sourcePoints, m_sourceNormals, 8);
+
+    // nearest neighbors are no exact correspondences, which biases the point-to-point constraints
+    expectPose(estimator.estimatePose(), 5e-3f);
+}
+
+TEST_F(PoseEstimatorTest, TestProjective)
+{
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSource(m_sourcePoints, m_sourceNormals, 8);
+
+    expectPose(estimator.estimatePose());
+}
+
+TEST_F(PoseEstimatorTest, TestProjectiveSubsampledTarget)
+{
+    // target raycast at every second pixel only
+    SurfaceMap target(60, 80);
+    Matrix3f intrinsics = m_intrinsics;
+    intrinsics.topRows(2) /= 2;
+    renderCorner(target, intrinsics, Matrix4f::Identity());
+
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    estimator.setTarget(target, Matrix4f::Identity(), 2);
+    estimator.setSource(m_sourcePoints, m_sourceNormals, 8);
+
+    expectPose(estimator.estimatePose());
+}
+
+TEST_F(PoseEstimatorTest, TestProjectivePyramid)
+{
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    estimator.setIterations({2, 3, 5});
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSourcePyramid(m_organizedSource, 120, 160, 1);
+
+    expectPose(estimator.estimatePose());
+}
+
+TEST_F(PoseEstimatorTest, TestProjectiveMeasuredPyramid)
+{
+    // pyramid as from SurfaceMeasurer: half the resolution per level, the pixels are the centers of 2x2 blocks
+    std::vector<SurfaceMap> pyramid;
+    Matrix3f intrinsics = m_intrinsics;
+    for(size_t level = 0; level < 3; ++level)
+    {
+        const size_t height = 120 >> level, width = 160 >> level;
+        const PointCloud measured = measure(height, width, intrinsics);
+        pyramid.emplace_back(height, width);
+        for(size_t i = 0; i < measured.points.size(); ++i)
+        {
+            pyramid.back().setInvalid(i);
+            if(measured.pointsValid[i] && measured.normalsValid[i])
+            {
+                pyramid.back().setPoint(i, measured.points[i]);
+                pyramid.back().setNormal(i, measured.normals[i]);
+            }
+        }
+        intrinsics.block<2,2>(0,0) /= 2;
+        intrinsics.block<2,1>(0,2) = (intrinsics.block<2,1>(0,2) - Vector2f::Constant(0.5f)) / 2;
+    }
+
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    // the fourth level strides the coarsest pyramid level
+    estimator.setIterations({2, 3, 5, 5});
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSourcePyramid(pyramid, 2);
+
+    expectPose(estimator.estimatePose());
+    EXPECT_EQ(estimator.getIterations().front().level, 3);
+}
+
+TEST_F(PoseEstimatorTest, TestRobustKernel)
+{
+    // every 5th source point is moved 3 cm along its normal
+    std::vector<Vector3f> points = m_sourcePoints;
+    for(size_t i = 0; i < points.size(); i += 5)
+    {
+        points[i] += 0.03f * m_sourceNormals[i];
+    }
+
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    estimator.setIterations({10});
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSource(points, m_sourceNormals, 2);
+
+    // least squares is biased by the outliers
+    const float leastSquaresError = (estimator.estimatePose().block<3,1>(0,3) - m_truePose.block<3,1>(0,3)).norm();
+    EXPECT_GT(leastSquaresError, 5e-3f);
+
+    estimator.setDepthWeighting(true);
+    estimator.setRobustKernel(RobustKernel::Huber, 1e-3f);
+    EXPECT_LT((estimator.estimatePose().block<3,1>(0,3) - m_truePose.block<3,1>(0,3)).norm(), 0.5f * leastSquaresError);
+
+    // the outliers get weight 0 once the threshold has adapted to the inliers
+    estimator.setRobustKernel(RobustKernel::Tukey, 1e-3f);
+    expectPose(estimator.estimatePose());
+}
+
+TEST_F(PoseEstimatorTest, TestConvergence)
+{
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    estimator.setIterations({50});
+    estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+    estimator.setSource(m_sourcePoints, m_sourceNormals);
+
+    expectPose(estimator.estimatePose());
+
+    // stops early on the exact correspondences
+    const auto& iterations = estimator.getIterations();
+    ASSERT_FALSE(iterations.empty());
+    EXPECT_LT(iterations.size(), 50u);
+    EXPECT_LT(iterations.back().error, iterations.front().error);
+    for (const auto& iteration : iterations)
+    {
+        EXPECT_FALSE(iteration.rejected);
+        EXPECT_GT(iteration.nInliers, iteration.nSourcePoints / 2);
+    }
+}
+
+TEST_F(PoseEstimatorTest, TestNormalSpaceSampling)
+{
+    // the three walls are sampled equally, though they cover different areas of the image
+    ProjectivePoseEstimator estimator(m_intrinsics);
+    const auto& samples = estimator.sampleNormalSpace(m_sourceNormals, 300);
+    ASSERT_EQ(samples.size(), 300u);
+    EXPECT_TRUE(std::is_sorted(samples.begin(), samples.end()));
+
+    std::array<int, 3> nPerWall = {0, 0, 0};
+    for (size_t i : samples)
+    {
+        int axis;
+        m_sourceNormals[i].cwiseAbs().maxCoeff(&axis);
+        ++nPerWall[axis];
+    }
+    for (int n : nPerWall)
+    {
+        EXPECT_EQ(n, 100);
+    }
+}
+
+TEST_F(PoseEstimatorTest, TestSampledPyramid)
+{
+    for (auto method : {SamplingMethod::NormalSpace, SamplingMethod::Covariance})
+    {
+        ProjectivePoseEstimator estimator(m_intrinsics);
+        estimator.setIterations({2, 3, 5});
+        estimator.setSampling(method, 2000);
+        estimator.setTarget(m_target, Matrix4f::Identity(), 1);
+        estimator.setSourcePyramid(m_organizedSource, 120, 160, 1);
+
+        expectPose(estimator.estimatePose());
+    }
+}
@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include "PosePredictor.h"
+
+static Matrix4f makePose(float angle, const Vector3f& axis, const Vector3f& translation)
+{
+    Matrix4f pose = Matrix4f::Identity();
+    pose.block<3,3>(0,0) = AngleAxisf(angle, axis.normalized()).toRotationMatrix();
+    pose.block<3,1>(0,3) = translation;
+    return pose;
+}
+
+TEST(PosePredictorTest, TestConstantVelocity)
+{
+    PosePredictor predictor;
+    EXPECT_TRUE(predictor.predict().isIdentity());
+
+    const Matrix4f motion = makePose(0.05f, Vector3f(0, 1, 0.2f), Vector3f(0.01f, 0, 0.02f));
+    Matrix4f pose = makePose(0.3f, Vector3f(1, 0, 0), Vector3f(1, 2, 3));
+    predictor.addPose(pose);
+    EXPECT_TRUE(predictor.predict().isApprox(pose));
+
+    for (int i = 0; i < 3; ++i)
+    {
+        pose = pose * motion;
+        predictor.addPose(pose);
+    }
+    EXPECT_TRUE(predictor.predict().isApprox(pose * motion, 1e-5f));
+
+    predictor.reset();
+    EXPECT_TRUE(predictor.predict().isIdentity());
+}
+
+TEST(PosePredictorTest, TestScale)
+{
+    const Matrix4f motion = makePose(0.2f, Vector3f(1, 2, 3), Vector3f(0.1f, -0.2f, 0.05f));
+
+    // half the motion twice is the motion
+    const Matrix4f half = PosePredictor::scale(motion, 0.5f);
+    EXPECT_TRUE((half * half).isApprox(motion, 1e-5f));
+    EXPECT_TRUE(PosePredictor::scale(motion, 1.f).isApprox(motion, 1e-5f));
+    EXPECT_TRUE(PosePredictor::scale(motion, 0.f).isIdentity(1e-6f));
+}
@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+#include "SpscQueue.h"
+
+TEST(SpscQueueTest, TestBounded)
+{
+    SpscQueue<int> queue(2);
+    int value = 1;
+    EXPECT_TRUE(queue.tryPush(value));
+    value = 2;
+    EXPECT_TRUE(queue.tryPush(value));
+    value = 3;
+    EXPECT_FALSE(queue.tryPush(value));
+
+    EXPECT_TRUE(queue.tryPop(value));
+    EXPECT_EQ(value, 1);
+    EXPECT_TRUE(queue.tryPop(value));
+    EXPECT_EQ(value, 2);
+    EXPECT_FALSE(queue.tryPop(value));
+}
+
+TEST(SpscQueueTest, TestOrderAcrossThreads)
+{
+    const int n = 10000;
+    SpscQueue<int> queue(3);
+    std::thread producer([&queue]()
+    {
+        for(int i = 0; i < n; ++i)
+        {
+            queue.push(i);
+        }
+    });
+
+    int value;
+    int expected = 0;
+    while(expected < n && queue.pop(value))
+    {
+        if(value != expected)
+        {
+            break;
+        }
+        ++expected;
+    }
+    producer.join();
+    EXPECT_EQ(expected, n);
+}
+
+TEST(SpscQueueTest, TestClose)
+{
+    SpscQueue<int> queue(1);
+    std::thread consumer([&queue]()
+    {
+        int value;
+        // waits until the queue is closed
+        EXPECT_FALSE(queue.pop(value));
+    });
+    queue.close();
+    consumer.join();
+    EXPECT_FALSE(queue.push(1));
+}
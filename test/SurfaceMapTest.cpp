@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+#include "DataTypes.h"
+
+TEST(SurfaceMapTest, TestResize)
+{
+    SurfaceMap surfaceMap(2, 3);
+
+    EXPECT_EQ(surfaceMap.size(), 6);
+    EXPECT_EQ(surfaceMap.height(), 2);
+    EXPECT_EQ(surfaceMap.width(), 3);
+    EXPECT_EQ(surfaceMap.pointX.size(), 6);
+    EXPECT_EQ(surfaceMap.normalZ.size(), 6);
+}
+
+TEST(SurfaceMapTest, TestValidity)
+{
+    SurfaceMap surfaceMap(1, 3);
+
+    surfaceMap.setInvalid(0);
+    surfaceMap.setInvalid(1);
+    surfaceMap.setInvalid(2);
+
+    surfaceMap.setPoint(1, Vector3f(1, 2, 3));
+    surfaceMap.setNormalInvalid(1);
+
+    surfaceMap.setPoint(2, Vector3f(4, 5, 6));
+    surfaceMap.setNormal(2, Vector3f(0, 0, -1));
+
+    EXPECT_FALSE(surfaceMap.pointValid(0));
+    EXPECT_FALSE(surfaceMap.valid(0));
+
+    EXPECT_TRUE(surfaceMap.pointValid(1));
+    EXPECT_FALSE(surfaceMap.normalValid(1));
+    EXPECT_FALSE(surfaceMap.valid(1));
+
+    EXPECT_TRUE(surfaceMap.valid(2));
+    EXPECT_EQ(surfaceMap.point(2), Vector3f(4, 5, 6));
+    EXPECT_EQ(surfaceMap.normal(2), Vector3f(0, 0, -1));
+}
+
+TEST(SurfaceMapTest, TestCompact)
+{
+    SurfaceMap surfaceMap(2, 2);
+    for(size_t i = 0; i < surfaceMap.size(); ++i)
+    {
+        surfaceMap.setInvalid(i);
+    }
+    surfaceMap.setPoint(1, Vector3f(1, 1, 1));
+    surfaceMap.setNormal(1, Vector3f(1, 0, 0));
+    surfaceMap.setPoint(3, Vector3f(3, 3, 3));
+    surfaceMap.setNormal(3, Vector3f(0, 1, 0));
+    // point without normal gets pruned
+    surfaceMap.setPoint(2, Vector3f(2, 2, 2));
+
+    PointCloud pointCloud(10);
+    surfaceMap.compact(pointCloud);
+
+    ASSERT_EQ(pointCloud.points.size(), 2);
+    ASSERT_EQ(pointCloud.normals.size(), 2);
+    EXPECT_EQ(pointCloud.pointsValid.size(), 2);
+    EXPECT_EQ(pointCloud.normalsValid.size(), 2);
+    EXPECT_EQ(pointCloud.points[0], Vector3f(1, 1, 1));
+    EXPECT_EQ(pointCloud.points[1], Vector3f(3, 3, 3));
+    EXPECT_EQ(pointCloud.normals[1], Vector3f(0, 1, 0));
+}
+
+TEST(SurfaceMapTest, TestPrune)
+{
+    PointCloud pointCloud(1000);
+    size_t nValid = 0;
+    for(size_t i = 0; i < pointCloud.points.size(); ++i)
+    {
+        pointCloud.points[i] = Vector3f(i, 0, 0);
+        pointCloud.normals[i] = Vector3f(0, i, 0);
+        pointCloud.pointsValid[i] = i % 3 != 0;
+        pointCloud.normalsValid[i] = i % 5 != 0;
+        nValid += pointCloud.pointsValid[i] && pointCloud.normalsValid[i];
+    }
+
+    pointCloud.prune();
+
+    ASSERT_EQ(pointCloud.points.size(), nValid);
+    ASSERT_EQ(pointCloud.normals.size(), nValid);
+    EXPECT_EQ(pointCloud.pointsValid.size(), nValid);
+    EXPECT_EQ(pointCloud.normalsValid.size(), nValid);
+    // order is kept
+    EXPECT_EQ(pointCloud.points[0], Vector3f(1, 0, 0));
+    EXPECT_EQ(pointCloud.normals[1], Vector3f(0, 2, 0));
+    EXPECT_EQ(pointCloud.points[nValid - 1], Vector3f(998, 0, 0));
+
+    // pruning again keeps everything
+    pointCloud.prune();
+    EXPECT_EQ(pointCloud.points.size(), nValid);
+    EXPECT_EQ(pointCloud.points[nValid - 1], Vector3f(998, 0, 0));
+}
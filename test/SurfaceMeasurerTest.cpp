@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+#include "SurfaceMeasurer.h"
+
+class SurfaceMeasurerTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        m_intrinsics << 100.f, 0, 31.5f,
+                        0, 100.f, 23.5f,
+                        0, 0, 1;
+
+        // fronto-parallel planes at 1 m (x < 30) and 2 m, one invalid pixel
+        m_depth.resize(m_height*m_width);
+        for(size_t y = 0; y < m_height; ++y)
+        {
+            for(size_t x = 0; x < m_width; ++x)
+            {
+                m_depth[y*m_width + x] = x < 30 ? 1.f : 2.f;
+            }
+        }
+        m_depth[10*m_width + 10] = MINF;
+    }
+
+    const size_t m_height = 48;
+    const size_t m_width = 64;
+    Matrix3f m_intrinsics;
+    std::vector<float> m_depth;
+};
+
+TEST_F(SurfaceMeasurerTest, TestPyramid)
+{
+    SurfaceMeasurer measurer(m_intrinsics, m_height, m_width, 3);
+    measurer.registerInput(m_depth.data());
+    measurer.process();
+
+    // the input is not modified
+    EXPECT_EQ(m_depth[10*m_width + 10], MINF);
+    EXPECT_EQ(m_depth[0], 1.f);
+
+    ASSERT_EQ(measurer.getLevels(), 3u);
+    for(size_t level = 0; level < 3; ++level)
+    {
+        EXPECT_EQ(measurer.getHeight(level), m_height >> level);
+        EXPECT_EQ(measurer.getWidth(level), m_width >> level);
+
+        const SurfaceMap& surfaceMap = measurer.getSurfaceMap(level);
+        ASSERT_EQ(surfaceMap.height(), measurer.getHeight(level));
+        ASSERT_EQ(surfaceMap.width(), measurer.getWidth(level));
+
+        // no depth is averaged over the step, each pixel projects back to itself
+        const Matrix3f& intrinsics = measurer.getIntrinsics(level);
+        for(size_t y = 0; y < measurer.getHeight(level); ++y)
+        {
+            for(size_t x = 0; x < measurer.getWidth(level); ++x)
+            {
+                const size_t idx = y*measurer.getWidth(level) + x;
+                if(!surfaceMap.pointValid(idx))
+                {
+                    EXPECT_FALSE(surfaceMap.normalValid(idx));
+                    continue;
+                }
+                const Vector3f point = surfaceMap.point(idx);
+                EXPECT_TRUE(point.z() == 1.f || point.z() == 2.f) << point.z();
+                const Vector3f pixel = intrinsics * point / point.z();
+                EXPECT_NEAR(pixel.x(), x, 1e-3f);
+                EXPECT_NEAR(pixel.y(), y, 1e-3f);
+
+                // the planes face the camera, there are no normals at the border and the step
+                const bool border = x == 0 || y == 0 || x + 1 == surfaceMap.width() || y + 1 == surfaceMap.height();
+                const float* depth = measurer.getSmoothedDepth(level) + y*surfaceMap.width();
+                const bool step = !border && depth[x - 1] != depth[x + 1];
+                if(border || step)
+                {
+                    EXPECT_FALSE(surfaceMap.normalValid(idx));
+                }
+                else if(surfaceMap.normalValid(idx))
+                {
+                    EXPECT_NEAR(surfaceMap.normal(idx).z(), -1.f, 1e-5f);
+                }
+            }
+        }
+    }
+
+    // the invalid pixel is averaged away on the next level
+    EXPECT_FALSE(measurer.getSurfaceMap(0).pointValid(10*m_width + 10));
+    EXPECT_TRUE(measurer.getSurfaceMap(1).pointValid(5*(m_width/2) + 5));
+}
@@ -0,0 +1,250 @@
+#include <gtest/gtest.h>
+#include "SurfacePredictor.h"
+
+// tsdf with the linear distance function value(p) = gradient.dot(p) + offset, observed everywhere
+class SurfacePredictorTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        m_intrinsics << 60.f, 0, 31.5f,
+                        0, 60.f, 23.5f,
+                        0, 0, 1;
+    }
+
+    void fillLinear(const Vector3f& gradient, float offset)
+    {
+        for(size_t idx = 0; idx < m_size*m_size*m_size; ++idx)
+        {
+            (*m_tsdf)(idx) = gradient.dot(m_tsdf->getPoint(idx).head(3)) + offset;
+            m_tsdf->weight(idx) = 1;
+        }
+    }
+
+    // camera to world, looking along +z from near the front of the volume
+    static Matrix4f cameraPose(float x, float y, float z)
+    {
+        Matrix4f pose = Matrix4f::Identity();
+        pose.block<3,1>(0,3) = Vector3f(x, y, z);
+        return pose;
+    }
+
+    const size_t m_size = 32;
+    const float m_voxelSize = 0.05f;
+    std::shared_ptr<Tsdf> m_tsdf = std::make_shared<Tsdf>(m_size, m_voxelSize);
+    Matrix3f m_intrinsics;
+};
+
+TEST_F(SurfacePredictorTest, TestSampleGradient)
+{
+    const Vector3f gradient(0.3f, -0.5f, 0.8f);
+    fillLinear(gradient, 0.1f);
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    // central differences of the sampled values, within a cell
+    const float h = 0.005f;
+    for(const Vector3f& point : {Vector3f(0.31f, 0.72f, 0.53f), Vector3f(1.01f, 0.22f, 1.34f)})
+    {
+        float value;
+        Vector3f analytic;
+        ASSERT_FALSE(predictor.sample(point, value, analytic));
+        EXPECT_NEAR(value, gradient.dot(point) + 0.1f, 1e-4f);
+
+        Vector3f numeric;
+        for(int dim = 0; dim < 3; ++dim)
+        {
+            float plus, minus;
+            Vector3f unused;
+            predictor.sample(point + h * Vector3f::Unit(dim), plus, unused);
+            predictor.sample(point - h * Vector3f::Unit(dim), minus, unused);
+            numeric[dim] = (plus - minus) / (2 * h);
+        }
+        EXPECT_LT((analytic - gradient).norm(), 1e-3f);
+        EXPECT_LT((analytic - numeric).norm(), 1e-2f);
+    }
+}
+
+TEST_F(SurfacePredictorTest, TestSampleUpperBoundary)
+{
+    const Vector3f gradient(0.3f, -0.5f, 0.8f);
+    fillLinear(gradient, 0.1f);
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    // on the last voxel layer in z only, x and y are inside
+    const float upper = (m_size - 1) * m_voxelSize;
+    const Vector3f point(0.31f, 0.72f, upper);
+    float value;
+    Vector3f analytic;
+    ASSERT_FALSE(predictor.sample(point, value, analytic));
+    EXPECT_NEAR(value, gradient.dot(point) + 0.1f, 1e-4f);
+    EXPECT_LT((analytic - gradient).norm(), 1e-3f);
+}
+
+TEST_F(SurfacePredictorTest, TestSampleUnobserved)
+{
+    fillLinear(Vector3f(0, 0, 1), 0);
+    m_tsdf->weight(m_tsdf->ravel_index(6, 14, 10)) = 0;
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    float value;
+    Vector3f gradient;
+    EXPECT_TRUE(predictor.sample(Vector3f(0.31f, 0.72f, 0.53f), value, gradient));
+}
+
+TEST_F(SurfacePredictorTest, TestRenderBatch)
+{
+    // plane z = 0.8 facing the cameras
+    fillLinear(Vector3f(0, 0, -1), 0.8f);
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    std::vector<RenderView> views(3);
+    for(size_t i = 0; i < views.size(); ++i)
+    {
+        views[i].pose = cameraPose(0.6f + 0.1f*i, 0.7f, 0.1f + 0.05f*i);
+        views[i].intrinsics = m_intrinsics;
+        views[i].height = 48;
+        views[i].width = 64;
+    }
+    views[2].pose.block<3,3>(0,0) = AngleAxisf(0.2f, Vector3f(0, 1, 0)).toRotationMatrix();
+
+    std::vector<RenderedView> batch(views.size());
+    std::vector<std::atomic<int>> calls(views.size());
+    predictor.render(views, [&](size_t i, RenderedView& rendered)
+    {
+        ++calls[i];
+        batch[i] = std::move(rendered);
+    });
+
+    for(size_t i = 0; i < views.size(); ++i)
+    {
+        EXPECT_EQ(calls[i], 1);
+        RenderedView single;
+        predictor.render(views[i], single);
+        EXPECT_EQ(batch[i].height, single.height);
+        EXPECT_EQ(batch[i].width, single.width);
+        EXPECT_EQ(batch[i].color, single.color);
+        EXPECT_EQ(batch[i].depth, single.depth);
+        EXPECT_EQ(batch[i].normals, single.normals);
+    }
+    // the center ray of the first view hits the plane
+    EXPECT_NEAR(batch[0].depth[24*64 + 32], 0.7f, 1e-3f);
+}
+
+TEST_F(SurfacePredictorTest, TestRaycastPlane)
+{
+    // plane z = 0.8, the distance is positive in front of it
+    fillLinear(Vector3f(0, 0, -1), 0.8f);
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    const Matrix4f pose = cameraPose(0.775f, 0.775f, 0.1f);
+    SurfaceMap surfaceMap(48, 64);
+    predictor.predict(surfaceMap, pose);
+
+    for(size_t y = 0; y < surfaceMap.height(); ++y)
+    {
+        for(size_t x = 0; x < surfaceMap.width(); ++x)
+        {
+            const size_t idx = y*surfaceMap.width() + x;
+            ASSERT_TRUE(surfaceMap.valid(idx));
+            // the hit is on the plane and on the ray of the pixel
+            const Vector3f point = surfaceMap.point(idx);
+            EXPECT_NEAR(point.z(), 0.8f, 1e-4f);
+            const Vector3f ray = point - pose.block<3,1>(0,3);
+            EXPECT_NEAR(ray.x() / ray.z(), (x - 31.5f) / 60.f, 1e-4f);
+            EXPECT_NEAR(ray.y() / ray.z(), (y - 23.5f) / 60.f, 1e-4f);
+            EXPECT_LT((surfaceMap.normal(idx) - Vector3f(0, 0, -1)).norm(), 1e-3f);
+        }
+    }
+}
+
+TEST_F(SurfacePredictorTest, TestRaycastBackFace)
+{
+    fillLinear(Vector3f(0, 0, -1), 0.8f);
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    // behind the plane looking back at it, the distance goes from negative to positive
+    Matrix4f pose = cameraPose(0.775f, 0.775f, 1.45f);
+    pose.block<3,3>(0,0) = AngleAxisf(M_PI, Vector3f(0, 1, 0)).toRotationMatrix();
+    SurfaceMap surfaceMap(48, 64);
+    predictor.predict(surfaceMap, pose);
+
+    for(size_t idx = 0; idx < surfaceMap.size(); ++idx)
+    {
+        EXPECT_FALSE(surfaceMap.pointValid(idx));
+    }
+}
+
+TEST_F(SurfacePredictorTest, TestRaycastUnobserved)
+{
+    fillLinear(Vector3f(0, 0, -1), 0.8f);
+    // the space around the camera is unobserved, the plane is observed
+    for(size_t idx = 0; idx < m_size*m_size*m_size; ++idx)
+    {
+        if(m_tsdf->getPoint(idx).z() < 0.4f)
+        {
+            m_tsdf->weight(idx) = 0;
+        }
+    }
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    const Matrix4f pose = cameraPose(0.775f, 0.775f, 0.1f);
+    SurfaceMap surfaceMap(48, 64);
+    predictor.predict(surfaceMap, pose);
+    for(size_t idx = 0; idx < surfaceMap.size(); ++idx)
+    {
+        ASSERT_TRUE(surfaceMap.pointValid(idx));
+        EXPECT_NEAR(surfaceMap.point(idx).z(), 0.8f, 1e-4f);
+    }
+
+    // without any observation there is no surface
+    for(size_t idx = 0; idx < m_size*m_size*m_size; ++idx)
+    {
+        m_tsdf->weight(idx) = 0;
+    }
+    predictor.predict(surfaceMap, pose);
+    for(size_t idx = 0; idx < surfaceMap.size(); ++idx)
+    {
+        EXPECT_FALSE(surfaceMap.pointValid(idx));
+    }
+}
+
+TEST_F(SurfacePredictorTest, TestPredictSparse)
+{
+    // tilted plane, partly unobserved so some pixels have no surface
+    fillLinear(Vector3f(0.3f, 0.2f, -1).normalized(), 0.8f);
+    for(size_t idx = 0; idx < m_size*m_size*m_size; ++idx)
+    {
+        if(m_tsdf->getPoint(idx).x() > 1.1f)
+        {
+            m_tsdf->weight(idx) = 0;
+        }
+    }
+    SurfacePredictor predictor(m_tsdf, m_intrinsics);
+
+    Matrix4f pose = cameraPose(0.775f, 0.775f, 0.1f);
+    pose.block<3,3>(0,0) = AngleAxisf(0.2f, Vector3f(0, 1, 0)).toRotationMatrix();
+    SurfaceMap dense(48, 64);
+    predictor.predict(dense, pose);
+
+    const std::vector<uint> pixels = SurfacePredictor::subsampledPixels(48, 64, 2);
+    ASSERT_EQ(pixels.size(), 24u*32u);
+    SurfaceMap sparse(24, 32);
+    predictor.predict(sparse, pixels, 64, pose);
+
+    size_t nValid = 0;
+    for(size_t i = 0; i < pixels.size(); ++i)
+    {
+        ASSERT_EQ(sparse.mask[i], dense.mask[pixels[i]]);
+        if(sparse.pointValid(i))
+        {
+            EXPECT_EQ(sparse.point(i), dense.point(pixels[i]));
+            ++nValid;
+        }
+        if(sparse.normalValid(i))
+        {
+            EXPECT_EQ(sparse.normal(i), dense.normal(pixels[i]));
+        }
+    }
+    EXPECT_GT(nValid, 0u);
+    EXPECT_LT(nValid, pixels.size());
+}
@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+#include "ThreadPool.h"
+
+TEST(ThreadPoolTest, TestParallelFor)
+{
+    ThreadPool pool(3);
+    std::vector<int> visited(1000, 0);
+    pool.parallelFor(visited.size(), [&visited](size_t i)
+    {
+        ++visited[i];
+    });
+    EXPECT_EQ(std::count(visited.begin(), visited.end(), 1), visited.size());
+}
+
+TEST(ThreadPoolTest, TestNested)
+{
+    // the inner loops run on the same workers as the outer loop
+    ThreadPool pool(2);
+    std::vector<std::atomic<int>> sums(16);
+    pool.parallelFor(sums.size(), [&](size_t i)
+    {
+        pool.parallelFor(100, [&](size_t j)
+        {
+            sums[i] += j;
+        });
+    });
+    for(const auto& sum : sums)
+    {
+        EXPECT_EQ(sum, 4950);
+    }
+}
+
+TEST(ThreadPoolTest, TestSubmit)
+{
+    ThreadPool pool(2);
+    std::atomic<int> counter{0};
+    std::vector<std::future<void>> futures;
+    for(int i = 0; i < 10; ++i)
+    {
+        futures.push_back(pool.submit([&counter]() { ++counter; }));
+    }
+    // the waiting thread runs tasks as well
+    pool.waitUntil([&futures]()
+    {
+        return std::all_of(futures.begin(), futures.end(), [](const std::future<void>& future)
+        {
+            return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+    });
+    EXPECT_EQ(counter, 10);
+}